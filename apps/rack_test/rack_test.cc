@@ -231,6 +231,10 @@ extern "C" void app_main(void* param) {
                  coralmicro::testlib::StartM4);
   jsonrpc_export(coralmicro::testlib::kMethodGetTemperature,
                  coralmicro::testlib::GetTemperature);
+  jsonrpc_export(coralmicro::testlib::kMethodSetTpuProfiling,
+                 coralmicro::testlib::SetTpuProfiling);
+  jsonrpc_export(coralmicro::testlib::kMethodGetTpuProfile,
+                 coralmicro::testlib::GetTpuProfile);
   jsonrpc_export(kMethodM4XOR, M4XOR);
   jsonrpc_export(coralmicro::testlib::kMethodCaptureTestPattern,
                  coralmicro::testlib::CaptureTestPattern);
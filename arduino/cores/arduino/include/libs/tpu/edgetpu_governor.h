@@ -0,0 +1 @@
+../../../../../../libs/tpu/edgetpu_governor.h
\ No newline at end of file
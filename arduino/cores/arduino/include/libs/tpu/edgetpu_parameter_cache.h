@@ -0,0 +1 @@
+../../../../../../libs/tpu/edgetpu_parameter_cache.h
\ No newline at end of file
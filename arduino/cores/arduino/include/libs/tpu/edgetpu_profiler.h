@@ -0,0 +1 @@
+../../../../../../libs/tpu/edgetpu_profiler.h
\ No newline at end of file
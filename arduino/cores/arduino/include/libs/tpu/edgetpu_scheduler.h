@@ -0,0 +1 @@
+../../../../../../libs/tpu/edgetpu_scheduler.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../../../libs/tpu/edgetpu_usb_transport.h
\ No newline at end of file
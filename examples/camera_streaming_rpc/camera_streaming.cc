@@ -54,6 +54,8 @@ std::optional<CameraFilterMethod> CheckCameraFilterMethod(
 
   if (method == "NEAREST_NEIGHBOR") return CameraFilterMethod::kNearestNeighbor;
 
+  if (method == "BINNING") return CameraFilterMethod::kBinning;
+
   return std::nullopt;
 }
 
@@ -37,7 +37,7 @@ parser.add_argument('--image_rotation', type=int, default=270,
 parser.add_argument('--image_format', type=str, default='RGB',
                     choices=['RGB', 'GRAY', 'RAW'], help='Pixel format')
 parser.add_argument('--image_filter', type=str, default='BILINEAR',
-                    choices=['BILINEAR', 'NEAREST_NEIGHBOR'], help='Demosaic interpolation method')
+                    choices=['BILINEAR', 'NEAREST_NEIGHBOR', 'BINNING'], help='Demosaic interpolation method')
 parser.add_argument('--auto_white_balance',
                     action='store_true', help='Enable white balancing')
 parser.add_argument('--noauto_white_balance',
@@ -96,7 +96,8 @@ def get_image_from_camera(ip, width, height, format, filter, rotation, auto_whit
     width: Width of the output image, in pixels.
     height: Height of the output image, in pixels.
     format: Pixel format of the output image (RGB, GRAY, RAW).
-    filter: Demosaic filter applied to the output image (BILINEAR, NEAREST_NEIGHBOR).
+    filter: Demosaic filter applied to the output image (BILINEAR, NEAREST_NEIGHBOR,
+      BINNING).
     rotation: Degrees of rotation applied to the output image (0, 90, 180, 270).
     auto_white_balance: White balance the image as true; do nothing otherwise.
   Returns:
@@ -44,6 +44,7 @@ enum {
   kRandomTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kPmicTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kCameraTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
+  kCameraPipelineTaskPriority = TaskPriority<configMAX_PRIORITIES - 2>,
   kAudioTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
 };
 #elif (__CORTEX_M == 4)
@@ -52,6 +53,7 @@ enum {
   kConsoleTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kAppTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kCameraTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
+  kCameraPipelineTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kPmicTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
 };
 #else
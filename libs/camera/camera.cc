@@ -18,6 +18,8 @@
 
 #include "libs/base/check.h"
 #include "libs/base/gpio.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
 #include "libs/pmic/pmic.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_csi.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_lpi2c.h"
@@ -29,13 +31,15 @@
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/cm4/fsl_cache.h"
 #endif
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include <cstring>
-#include <memory>
+#include <vector>
 
 namespace coralmicro {
 namespace {
 constexpr uint8_t kCameraAddress = 0x24;
-constexpr int kFramebufferCount = 4;
 constexpr float kRedCoefficient = .2126;
 constexpr float kGreenCoefficient = .7152;
 constexpr float kBlueCoefficient = .0722;
@@ -110,17 +114,18 @@ struct CameraRegisters {
 
 __attribute__((section(".sdram_bss,\"aw\",%nobits @")))
 __attribute__((aligned(64))) uint8_t
-    framebuffers[kFramebufferCount][CameraTask::kHeight][CameraTask::kWidth];
+    framebuffers[CameraTask::kMaxFramebufferCount][CameraTask::kHeight]
+                [CameraTask::kWidth];
 
 uint8_t* IndexToFramebufferPtr(int index) {
-  if (index < 0 || index >= kFramebufferCount) {
+  if (index < 0 || index >= CameraTask::kMaxFramebufferCount) {
     return nullptr;
   }
   return reinterpret_cast<uint8_t*>(framebuffers[index]);
 }
 
 int FramebufferPtrToIndex(const uint8_t* framebuffer_ptr) {
-  for (int i = 0; i < kFramebufferCount; ++i) {
+  for (int i = 0; i < CameraTask::kMaxFramebufferCount; ++i) {
     if (reinterpret_cast<uint8_t*>(framebuffers[i]) == framebuffer_ptr) {
       return i;
     }
@@ -128,331 +133,784 @@ int FramebufferPtrToIndex(const uint8_t* framebuffer_ptr) {
   return -1;
 }
 
-void ResizeNearestNeighbor(const uint8_t* src, int src_w, int src_h,
-                           uint8_t* dst, int dst_w, int dst_h, int comps,
-                           bool preserve_aspect) {
-  int src_p = src_w * comps;
-  int dst_p = dst_w * comps;
-  float ratio_src = (float)src_w / src_h;
-  float ratio_dst = (float)dst_w / dst_h;
-  int scaled_w =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? src_w * (float)dst_h / src_h : dst_w)
-          : dst_w;
-  int scaled_h =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? dst_h : src_h * (float)dst_w / src_w)
-          : dst_h;
-  float ratio_x = (float)src_w / scaled_w;
-  float ratio_y = (float)src_h / scaled_h;
-
-  for (int y = 0; y < dst_h; y++) {
-    if (y >= scaled_h) {
-      std::memset(dst, 0, dst_p);
-      dst += dst_p;
-      continue;
-    }
+// Luma weighs each channel by the square of its value, which is tabulated in
+// 16.16 fixed point so that no floating point is needed per pixel.
+struct LumaTables {
+  uint32_t r[256];
+  uint32_t g[256];
+  uint32_t b[256];
+};
+
+constexpr LumaTables MakeLumaTables() {
+  LumaTables tables{};
+  for (int i = 0; i < 256; ++i) {
+    const double square = static_cast<double>(i) * i / kUint8Max * 65536;
+    tables.r[i] = static_cast<uint32_t>(kRedCoefficient * square + 0.5);
+    tables.g[i] = static_cast<uint32_t>(kGreenCoefficient * square + 0.5);
+    tables.b[i] = static_cast<uint32_t>(kBlueCoefficient * square + 0.5);
+  }
+  return tables;
+}
+
+constexpr LumaTables kLumaTables = MakeLumaTables();
 
-    int offset_y = static_cast<int>(y * ratio_y) * src_p;
-    for (int x = 0; x < dst_w; x++) {
-      int offset_x = static_cast<int>(x * ratio_x) * comps;
-      const uint8_t* src_y = src + offset_y;
-      for (int i = 0; i < comps; i++) {
-        *dst++ = x < scaled_w ? src_y[offset_x + i] : 0;
+uint8_t Luma(uint8_t r, uint8_t g, uint8_t b) {
+  return (kLumaTables.r[r] + kLumaTables.g[g] + kLumaTables.b[b]) >> 16;
+}
+
+// White balance gains in 8.8 fixed point.
+struct WhiteBalanceGains {
+  uint16_t r;
+  uint16_t g;
+  uint16_t b;
+};
+
+// Estimates gray world white balance gains from a sparse grid of the Bayer
+// quads of the raw image, leaving out strongly colored quads.
+WhiteBalanceGains BayerWhiteBalanceGains(const uint8_t* camera_raw, int width,
+                                         int height) {
+  // Every fourth quad in both directions; about 1600 of them at native size.
+  constexpr int kGridStep = 8;
+  unsigned int r_sum = 0, g_sum = 0, b_sum = 0;
+  const uint16_t threshold16 = static_cast<uint16_t>(0.9f * 255);
+  for (int y = 0; y + 1 < height; y += kGridStep) {
+    const uint8_t* row0 = camera_raw + y * width;
+    const uint8_t* row1 = row0 + width;
+    for (int x = 0; x + 1 < width; x += kGridStep) {
+      const uint8_t b = row0[x];
+      const uint8_t g = (row0[x + 1] + row1[x] + 1) >> 1;
+      const uint8_t r = row1[x + 1];
+      const uint16_t min_rgb = std::min(r, std::min(g, b));
+      const uint16_t max_rgb = std::max(r, std::max(g, b));
+      if (((max_rgb - min_rgb) * 255) > (threshold16 * max_rgb)) {
+        continue;
       }
+      r_sum += r;
+      g_sum += g;
+      b_sum += b;
     }
   }
+  const unsigned int max_channel = std::max(r_sum, std::max(g_sum, b_sum));
+  auto gain = [max_channel](unsigned int sum) -> uint16_t {
+    if (sum == 0) return 0;
+    return static_cast<uint16_t>(
+        std::min<uint64_t>(UINT16_MAX, (uint64_t{max_channel} << 8) / sum));
+  };
+  return {gain(r_sum), gain(g_sum), gain(b_sum)};
+}
+
+uint8_t ApplyGain(uint8_t value, uint16_t gain) {
+  return static_cast<uint8_t>(
+      std::min<uint32_t>(255, (static_cast<uint32_t>(value) * gain) >> 8));
 }
 
-template <typename Callback>
-void BayerInternal(const uint8_t* camera_raw, int width, int height,
-                   CameraFilterMethod filter, Callback callback) {
+// Demosaics the single pixel that the row kernels below report at `x`, `y`,
+// giving the same result. Pixels that they leave out on the image border are
+// taken from their nearest neighbor inside. `kBinning` has no row kernel; it
+// takes the 2x2 quad that holds the pixel.
+void DemosaicPixel(const uint8_t* camera_raw, int width, int height, int x,
+                   int y, CameraFilterMethod filter, uint8_t* r, uint8_t* g,
+                   uint8_t* b) {
+  if (filter == CameraFilterMethod::kBinning) {
+    x = std::clamp(x, 0, width - 2) & ~1;
+    y = std::clamp(y, 0, height - 2) & ~1;
+    const uint8_t* quad = camera_raw + y * width + x;
+    *r = quad[width + 1];
+    *g = (quad[1] + quad[width] + 1) >> 1;
+    *b = quad[0];
+    return;
+  }
   if (filter == CameraFilterMethod::kNearestNeighbor) {
-    bool blue = true, green = false;
-    for (int y = 2; y < height - 2; y++) {
-      int start = green ? 3 : 2;
-      for (int x = start; x < width - 2; x += 2) {
-        int g1x = x + 1, g1y = y;
-        int g2x = x + 2, g2y = y + 1;
-        int r1x, r1y, r2x, r2y;
-        int b1x, b1y, b2x, b2y;
-        if (blue) {
-          r1x = r2x = x + 1;
-          r1y = r2y = y + 1;
-          b1x = x;
-          b1y = y;
-          b2x = x + 2;
-          b2y = y;
-        } else {
-          r1x = x;
-          r1y = y;
-          r2x = x + 2;
-          r2y = y;
-          b1x = b2x = x + 1;
-          b1y = b2y = y + 1;
-        }
-        uint8_t r1 = camera_raw[r1x + (r1y * width)];
-        uint8_t g1 = camera_raw[g1x + (g1y * width)];
-        uint8_t b1 = camera_raw[b1x + (b1y * width)];
-        uint8_t r2 = camera_raw[r2x + (r2y * width)];
-        uint8_t g2 = camera_raw[g2x + (g2y * width)];
-        uint8_t b2 = camera_raw[b2x + (b2y * width)];
-        callback(x, y, r1, g1, b1);
-        callback(x + 1, y, r2, g2, b2);
+    x = std::clamp(x, 0, width - 2);
+    y = std::clamp(y, 0, height - 2);
+    const uint8_t* p = camera_raw + y * width + x;
+    // Each pixel takes the samples to its right and below, with red and
+    // blue shared by the pixel pair of the quad that holds them.
+    if (!(y & 1)) {
+      if (!(x & 1)) {
+        *r = p[width + 1];
+        *g = p[1];
+        *b = p[0];
+      } else {
+        *r = p[width];
+        *g = p[width + 1];
+        *b = p[1];
       }
-      blue = !blue;
-      green = !green;
-    }
-  } else if (filter == CameraFilterMethod::kBilinear) {
-    int bayer_stride = width;
-
-    size_t bayer_offset = 0;
-    for (int y = 2; y < height - 2; y++) {
-      bool odd_row = y & 1;
-      int x = 1;
-      size_t bayer_end = bayer_offset + (width - 2);
-
-      if (odd_row) {
-        uint8_t r = (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-                     static_cast<uint32_t>(
-                         camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-                     1) >>
-                    1;
-        uint8_t b =
-            (static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride + 2)]) +
-             1) >>
-            1;
-        uint8_t g = camera_raw[bayer_offset + (bayer_stride + 1)];
-        callback(x, y, r, g, b);
-        bayer_offset += 1;
-        ++x;
+    } else {
+      if (x & 1) {
+        *r = p[0];
+        *g = p[1];
+        *b = p[width + 1];
+      } else {
+        *r = p[1];
+        *g = p[width + 1];
+        *b = p[width];
       }
+    }
+    return;
+  }
 
-      while (bayer_offset <= (bayer_end - 2)) {
-        uint8_t r1 = 0, g1 = 0, b1 = 0, r2 = 0, g2 = 0, b2 = 0;
-        uint8_t t0 = (static_cast<uint32_t>(camera_raw[bayer_offset]) +
-                      static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      2) >>
-                     2;
-        g1 = (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-              static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-              static_cast<uint32_t>(
-                  camera_raw[bayer_offset + (bayer_stride + 2)]) +
-              static_cast<uint32_t>(
-                  camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-              2) >>
-             2;
-        uint8_t t1 = (static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      1) >>
-                     1;
-        uint8_t t2 = (static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride + 1)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride + 3)]) +
-                      1) >>
-                     1;
-        uint8_t t3 = camera_raw[bayer_offset + (bayer_stride + 1)];
-        g2 = camera_raw[bayer_offset + (bayer_stride + 2)];
-        if (odd_row) {
-          r1 = t0;
-          b1 = t3;
-
-          r2 = t1;
-          b2 = t2;
-        } else {
-          b1 = t0;
-          r1 = t3;
+  // Bilinear pixels are reported one row below their center sample.
+  const int row = std::clamp(y - 1, 1, height - 2);
+  const int col = std::clamp(x, 1, width - 2);
+  const uint8_t* p = camera_raw + row * width + col;
+  const uint32_t center = p[0];
+  const uint32_t cross = (p[-width] + p[width] + p[-1] + p[1] + 2) >> 2;
+  const uint32_t diagonal =
+      (p[-width - 1] + p[-width + 1] + p[width - 1] + p[width + 1] + 2) >> 2;
+  const uint32_t vertical = (p[-width] + p[width] + 1) >> 1;
+  const uint32_t horizontal = (p[-1] + p[1] + 1) >> 1;
+  const bool odd_row = row & 1;
+  const bool odd_col = col & 1;
+  if (!odd_row && !odd_col) {  // Blue
+    *r = diagonal;
+    *g = cross;
+    *b = center;
+  } else if (odd_row && odd_col) {  // Red
+    *r = center;
+    *g = cross;
+    *b = diagonal;
+  } else if (!odd_row) {  // Green on a blue row
+    *r = vertical;
+    *g = center;
+    *b = horizontal;
+  } else {  // Green on a red row
+    *r = horizontal;
+    *g = center;
+    *b = vertical;
+  }
+}
 
-          b2 = t1;
-          r2 = t2;
-        }
-        callback(x, y, r1, g1, b1);
-        callback(x + 1, y, r2, g2, b2);
-        bayer_offset += 2;
-        x += 2;
-      }
+// Sensor rows are demosaiced by row kernels that call `out(x, r, g, b)` for
+// each pixel. Pixels keep the coordinates the original per-pixel demosaic
+// gave them, so bilinear pixels are reported one row below their center
+// sample. The kernels cover the same pixels as before: bilinear rows fill
+// columns 1 to width - 2, nearest-neighbor rows fill 2 to width - 3 on even
+// rows and 3 to width - 2 on odd rows. Given a column range, they fill at
+// least the covered pixels within it.
+
+uint32_t Load32(const uint8_t* p) {
+  uint32_t word;
+  std::memcpy(&word, p, sizeof(word));
+  return word;
+}
 
-      while (bayer_offset < bayer_end) {
-        uint8_t t0 = (static_cast<uint32_t>(camera_raw[bayer_offset]) +
-                      static_cast<uint32_t>(camera_raw[bayer_offset + 2]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2)]) +
-                      static_cast<uint32_t>(
-                          camera_raw[bayer_offset + (bayer_stride * 2 + 2)]) +
-                      2) >>
-                     2;
-        uint8_t g =
-            (static_cast<uint32_t>(camera_raw[bayer_offset + 1]) +
-             static_cast<uint32_t>(camera_raw[bayer_offset + bayer_stride]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride + 2)]) +
-             static_cast<uint32_t>(
-                 camera_raw[bayer_offset + (bayer_stride * 2 + 1)]) +
-             2) >>
-            2;
-        uint8_t t1 = camera_raw[bayer_offset + bayer_stride + 1];
-        if (odd_row) {
-          callback(x, y, t0, g, t1);
-        } else {
-          callback(x, y, t1, g, t0);
-        }
-        bayer_offset += 1;
-        ++x;
-      }
+// Bytes 0 and 2, and bytes 1 and 3, of a word in 16-bit lanes, so that
+// several of them can be summed without carrying into each other.
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+uint32_t EvenBytes(uint32_t word) { return __UXTB16(word); }
+uint32_t OddBytes(uint32_t word) { return __UXTB16(__ROR(word, 8)); }
+#else
+uint32_t EvenBytes(uint32_t word) { return word & 0x00ff00ff; }
+uint32_t OddBytes(uint32_t word) { return (word >> 8) & 0x00ff00ff; }
+#endif
 
-      bayer_offset += 2;
+// Demosaics pixels `x` to `x_end - 1` of a bilinear row four at a time: two
+// blue or red ones from cross and diagonal averages, and two green ones from
+// vertical and horizontal averages. Returns the first pixel left over.
+//
+// Blue rows hold blue at even columns and red rows red at odd columns; the
+// other columns are green.
+template <bool kRedRow, typename Out>
+int DemosaicQuadsBilinear(const uint8_t* up, const uint8_t* mid,
+                          const uint8_t* down, int x, int x_end, Out out) {
+  auto color = [](uint32_t word) {
+    return kRedRow ? OddBytes(word) : EvenBytes(word);
+  };
+  auto green = [](uint32_t word) {
+    return kRedRow ? EvenBytes(word) : OddBytes(word);
+  };
+  for (; x + 4 <= x_end; x += 4) {
+    const uint32_t u = Load32(up + x), d = Load32(down + x);
+    const uint32_t m = Load32(mid + x);
+    const uint32_t ml = Load32(mid + x - 1), mr = Load32(mid + x + 1);
+    const uint32_t ul = Load32(up + x - 1), ur = Load32(up + x + 1);
+    const uint32_t dl = Load32(down + x - 1), dr = Load32(down + x + 1);
+
+    const uint32_t center = color(m);
+    const uint32_t cross_sum = color(u) + color(d) + color(ml) + color(mr);
+    const uint32_t cross = ((cross_sum + 0x00020002) >> 2) & 0x00ff00ff;
+    const uint32_t diagonal_sum = color(ul) + color(ur) + color(dl) + color(dr);
+    const uint32_t diagonal = ((diagonal_sum + 0x00020002) >> 2) & 0x00ff00ff;
+    const uint32_t g = green(m);
+    const uint32_t vertical =
+        ((green(u) + green(d) + 0x00010001) >> 1) & 0x00ff00ff;
+    const uint32_t horizontal =
+        ((green(ml) + green(mr) + 0x00010001) >> 1) & 0x00ff00ff;
+
+    for (int i = 0; i < 2; ++i) {
+      const int shift = i * 16;
+      const int color_x = x + kRedRow + i * 2;
+      const int green_x = x + !kRedRow + i * 2;
+      if (kRedRow) {
+        out(color_x, center >> shift, cross >> shift, diagonal >> shift);
+        out(green_x, horizontal >> shift, g >> shift, vertical >> shift);
+      } else {
+        out(color_x, diagonal >> shift, cross >> shift, center >> shift);
+        out(green_x, vertical >> shift, g >> shift, horizontal >> shift);
+      }
     }
   }
+  return x;
 }
 
-void RotateXY(CameraRotation rotation, int in_x, int in_y, int* out_x,
-              int* out_y) {
-  CHECK(out_x);
-  CHECK(out_y);
+template <typename Out>
+void DemosaicRowBilinear(const uint8_t* camera_raw, int width, int height,
+                         int y, int x_begin, int x_end, Out out) {
+  const uint8_t* up = camera_raw + (y - 2) * width;
+  const uint8_t* mid = up + width;
+  const uint8_t* down = mid + width;
+  auto pixel = [&](int x) {
+    uint8_t r, g, b;
+    DemosaicPixel(camera_raw, width, height, x, y,
+                  CameraFilterMethod::kBilinear, &r, &g, &b);
+    out(x, r, g, b);
+  };
 
-  // Short-circuit for no rotation
-  if (rotation == CameraRotation::k0) {
-    *out_x = in_x;
-    *out_y = in_y;
-    return;
+  if (x_begin <= 1) {
+    pixel(1);
+  }
+  // Quads start on an even column, and read one byte past their last pixel,
+  // which is still in the row.
+  const int x_start = std::max(2, x_begin & ~1);
+  x_end = std::min(x_end, width - 1);
+  int x = (y - 1) & 1
+              ? DemosaicQuadsBilinear<true>(up, mid, down, x_start, x_end, out)
+              : DemosaicQuadsBilinear<false>(up, mid, down, x_start, x_end,
+                                             out);
+  for (; x < x_end; ++x) {
+    pixel(x);
+  }
+}
+
+template <typename Out>
+void DemosaicRowNearestNeighbor(const uint8_t* camera_raw, int width, int y,
+                                int x_begin, int x_end, Out out) {
+  const uint8_t* row = camera_raw + y * width;
+  const uint8_t* next = row + width;
+  // Pixels come in pairs, from the first pair that reaches `x_begin`.
+  const int first = y & 1 ? 3 : 2;
+  const int x_start = first + (std::max(0, x_begin - first) & ~1);
+  x_end = std::min(x_end, width - 2);
+  if (!(y & 1)) {
+    for (int x = x_start; x < x_end; x += 2) {
+      out(x, next[x + 1], row[x + 1], row[x]);
+      out(x + 1, next[x + 1], next[x + 2], row[x + 2]);
+    }
+  } else {
+    for (int x = x_start; x < x_end; x += 2) {
+      out(x, row[x], row[x + 1], next[x + 1]);
+      out(x + 1, row[x + 2], next[x + 2], next[x + 1]);
+    }
   }
+}
 
-  // Shift our coordinates so that the center of the image is 0,0
-  in_x = in_x - (CameraTask::kWidth / 2);
-  in_y = in_y - (CameraTask::kHeight / 2);
+// Where the pixels of sensor row `y` land in an image rotated by `rotation`:
+// pixel `x` goes to pixel offset `offset + x * step`.
+struct RowTarget {
+  int offset;
+  int step;
+};
 
-  // Simple rotation around origin
+RowTarget RotatedRow(CameraRotation rotation, int width, int y) {
+  // Rotation is about the center of the native image.
+  constexpr int kSize = CameraTask::kWidth;
   switch (rotation) {
     case CameraRotation::k90:
-      *out_x = -in_y;
-      *out_y = in_x;
-      break;
+      return {kSize - y, width};
     case CameraRotation::k180:
-      *out_x = -in_x;
-      *out_y = -in_y;
-      break;
+      return {(kSize - y) * width + kSize, -1};
     case CameraRotation::k270:
-      *out_x = in_y;
-      *out_y = -in_x;
-      break;
+      return {kSize * width + y, -width};
     case CameraRotation::k0:
     default:
-      CHECK(false);
+      return {y * width, 1};
   }
+}
 
-  // Undo coordinate space shift
-  *out_x = *out_x + (CameraTask::kWidth / 2);
-  *out_y = *out_y + (CameraTask::kHeight / 2);
-  CHECK(*out_x >= 0);
-  CHECK(*out_x < static_cast<int>(CameraTask::kWidth));
-  CHECK(*out_y >= 0);
-  CHECK(*out_y < static_cast<int>(CameraTask::kHeight));
+// Demosaics columns `x_begin` to `x_end - 1` of sensor row `y`, or all of it
+// by default.
+template <typename Out>
+void DemosaicRow(const uint8_t* camera_raw, int width, int height, int y,
+                 CameraFilterMethod filter, Out out, int x_begin = 0,
+                 int x_end = INT_MAX) {
+  if (filter == CameraFilterMethod::kNearestNeighbor) {
+    DemosaicRowNearestNeighbor(camera_raw, width, y, x_begin, x_end, out);
+  } else {
+    DemosaicRowBilinear(camera_raw, width, height, y, x_begin, x_end, out);
+  }
 }
 
+// Applies `gains` as the pixels are written if it's non-null.
 void BayerToRgb(const uint8_t* camera_raw, uint8_t* camera_rgb, int width,
-                int height, CameraFilterMethod filter,
-                CameraRotation rotation) {
+                int height, CameraFilterMethod filter, CameraRotation rotation,
+                const WhiteBalanceGains* gains) {
   std::memset(camera_rgb, 0, width * height * 3);
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_rgb, width, height, rotation](int x, int y, uint8_t r,
-                                                      uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 0] = r;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 1] = g;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 2] = b;
-                });
+  for (int y = 2; y < height - 2; ++y) {
+    const RowTarget target = RotatedRow(rotation, width, y);
+    uint8_t* dst = camera_rgb + target.offset * 3;
+    const int step = target.step * 3;
+    if (gains) {
+      const WhiteBalanceGains g = *gains;
+      DemosaicRow(camera_raw, width, height, y, filter,
+                  [dst, step, g](int x, uint8_t r, uint8_t gr, uint8_t b) {
+                    uint8_t* p = dst + x * step;
+                    p[0] = ApplyGain(r, g.r);
+                    p[1] = ApplyGain(gr, g.g);
+                    p[2] = ApplyGain(b, g.b);
+                  });
+    } else {
+      DemosaicRow(camera_raw, width, height, y, filter,
+                  [dst, step](int x, uint8_t r, uint8_t g, uint8_t b) {
+                    uint8_t* p = dst + x * step;
+                    p[0] = r;
+                    p[1] = g;
+                    p[2] = b;
+                  });
+    }
+  }
 }
 
 void BayerToGrayscale(const uint8_t* camera_raw, uint8_t* camera_grayscale,
                       int width, int height, CameraFilterMethod filter,
                       CameraRotation rotation) {
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_grayscale, width, height, rotation](
-                    int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  float r_f = static_cast<float>(r) / kUint8Max;
-                  float g_f = static_cast<float>(g) / kUint8Max;
-                  float b_f = static_cast<float>(b) / kUint8Max;
-                  camera_grayscale[rot_x + (rot_y * width)] =
-                      static_cast<uint8_t>(((kRedCoefficient * r_f * r_f) +
-                                            (kGreenCoefficient * g_f * g_f) +
-                                            (kBlueCoefficient * b_f * b_f)) *
-                                           kUint8Max);
+  for (int y = 2; y < height - 2; ++y) {
+    const RowTarget target = RotatedRow(rotation, width, y);
+    uint8_t* dst = camera_grayscale + target.offset;
+    const int step = target.step;
+    DemosaicRow(camera_raw, width, height, y, filter,
+                [dst, step](int x, uint8_t r, uint8_t g, uint8_t b) {
+                  dst[x * step] = Luma(r, g, b);
                 });
+  }
 }
 
-void RgbToGrayscale(const uint8_t* camera_rgb, uint8_t* camera_grayscale,
-                    int width, int height) {
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      float r_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 0]) /
-          kUint8Max;
-      float g_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 1]) /
-          kUint8Max;
-      float b_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 2]) /
-          kUint8Max;
-      camera_grayscale[x + (y * width)] = static_cast<uint8_t>(
-          ((kRedCoefficient * r_f * r_f) + (kGreenCoefficient * g_f * g_f) +
-           (kBlueCoefficient * b_f * b_f)) *
-          kUint8Max);
+// Maps a pixel of the rotated native image back to the sensor coordinates
+// the row kernels report it under; the inverse of `RotatedRow()`.
+void UnrotateXY(CameraRotation rotation, int out_x, int out_y, int* in_x,
+                int* in_y) {
+  constexpr int kSize = CameraTask::kWidth;
+  switch (rotation) {
+    case CameraRotation::k0:
+      *in_x = out_x;
+      *in_y = out_y;
+      break;
+    case CameraRotation::k90:
+      *in_x = out_y;
+      *in_y = kSize - out_x;
+      break;
+    case CameraRotation::k180:
+      *in_x = kSize - out_x;
+      *in_y = kSize - out_y;
+      break;
+    case CameraRotation::k270:
+      *in_x = kSize - out_y;
+      *in_y = out_x;
+      break;
+  }
+}
+
+bool IsFullFrame(const CameraRoi& roi) {
+  return roi.width == 0 || roi.height == 0;
+}
+
+// Gets the region of the rotated native image that `fmt` is made from.
+CameraRoi SourceRoi(const CameraFrameFormat& fmt) {
+  if (IsFullFrame(fmt.roi)) {
+    return {0, 0, CameraTask::kWidth, CameraTask::kHeight};
+  }
+  return fmt.roi;
+}
+
+// Gets the size of the scaled image within the destination. It fills the
+// destination unless `preserve_ratio` is set, in which case the source region
+// is scaled to fit and the remaining pixels are zeroed.
+void ScaledSize(const CameraFrameFormat& fmt, int* scaled_w, int* scaled_h) {
+  const CameraRoi roi = SourceRoi(fmt);
+  *scaled_w = fmt.width;
+  *scaled_h = fmt.height;
+  if (fmt.preserve_ratio) {
+    if (fmt.width * roi.height > fmt.height * roi.width) {
+      *scaled_w = std::max(1, roi.width * fmt.height / roi.height);
+    } else {
+      *scaled_h = std::max(1, roi.height * fmt.width / roi.width);
     }
   }
 }
 
-void AutoWhiteBalance(uint8_t* camera_rgb, int width, int height) {
-  unsigned int r_sum = 0, g_sum = 0, b_sum = 0;
-  float r_sum_f = 0.0, g_sum_f = 0.0, b_sum_f = 0.0;
-  float threshold = 0.9f;
-  uint16_t threshold16 = static_cast<uint16_t>(threshold * 255);
-  uint16_t min_rgb, max_rgb;
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    min_rgb = static_cast<uint16_t>(std::min(r, std::min(g, b)));
-    max_rgb = static_cast<uint16_t>(std::max(r, std::max(g, b)));
-    if (((max_rgb - min_rgb) * 255) > (threshold16 * max_rgb)) {
-      continue;
+// Produces a scaled RGB or Y8 image straight from the raw frame, in one pass
+// over the destination: each destination pixel is mapped through the
+// nearest-neighbor resize and the rotation to a sensor pixel, which is
+// demosaiced, white balanced and converted on its own. Only the sampled
+// pixels are read, and no full-size intermediate image is needed.
+//
+// Resizing is nearest-neighbor. With `preserve_ratio` the image is scaled to
+// fit and the remaining pixels are zeroed.
+void BayerToScaled(const uint8_t* camera_raw, const CameraFrameFormat& fmt,
+                   const WhiteBalanceGains* gains) {
+  const CameraRoi roi = SourceRoi(fmt);
+  const int dst_w = fmt.width;
+  const int dst_h = fmt.height;
+  int scaled_w, scaled_h;
+  ScaledSize(fmt, &scaled_w, &scaled_h);
+  const bool rgb = fmt.fmt == CameraFormat::kRgb;
+  const int bpp = CameraFormatBpp(fmt.fmt);
+
+  // Source coordinates are stepped exactly, as a whole part and a remainder
+  // in units of 1 / scaled size, so there is no division per pixel.
+  uint8_t* dst = fmt.buffer;
+  int v = roi.y, v_rem = 0;
+  for (int y = 0; y < dst_h; ++y) {
+    if (y >= scaled_h) {
+      std::memset(dst, 0, (dst_h - y) * dst_w * bpp);
+      return;
+    }
+    int u = roi.x, u_rem = 0;
+    for (int x = 0; x < scaled_w; ++x) {
+      int sensor_x, sensor_y;
+      UnrotateXY(fmt.rotation, u, v, &sensor_x, &sensor_y);
+      uint8_t r, g, b;
+      DemosaicPixel(camera_raw, CameraTask::kWidth, CameraTask::kHeight,
+                    sensor_x, sensor_y, fmt.filter, &r, &g, &b);
+      if (gains) {
+        r = ApplyGain(r, gains->r);
+        g = ApplyGain(g, gains->g);
+        b = ApplyGain(b, gains->b);
+      }
+      if (rgb) {
+        *dst++ = r;
+        *dst++ = g;
+        *dst++ = b;
+      } else {
+        *dst++ = Luma(r, g, b);
+      }
+      u += roi.width / scaled_w;
+      u_rem += roi.width % scaled_w;
+      if (u_rem >= scaled_w) {
+        u_rem -= scaled_w;
+        ++u;
+      }
+    }
+    std::memset(dst, 0, (dst_w - scaled_w) * bpp);
+    dst += (dst_w - scaled_w) * bpp;
+    v += roi.height / scaled_h;
+    v_rem += roi.height % scaled_h;
+    if (v_rem >= scaled_h) {
+      v_rem -= scaled_h;
+      ++v;
+    }
+  }
+}
+
+// Whether the row kernels report the sensor pixel at `x`, `y`.
+bool RowKernelCovers(CameraFilterMethod filter, int x, int y) {
+  constexpr int kW = CameraTask::kWidth;
+  constexpr int kH = CameraTask::kHeight;
+  if (y < 2 || y > kH - 3) {
+    return false;
+  }
+  if (filter == CameraFilterMethod::kNearestNeighbor) {
+    return y & 1 ? x >= 3 && x <= kW - 2 : x >= 2 && x <= kW - 3;
+  }
+  return x >= 1 && x <= kW - 2;
+}
+
+// The rotated native image that resizers read from. Guarded by
+// `CameraTask::resize_mutex_`, like the resizers.
+__attribute__((section(".sdram_bss,\"aw\",%nobits @")))
+__attribute__((aligned(64))) uint8_t
+    resize_source[CameraTask::kHeight][CameraTask::kWidth * 3];
+
+// Resizes the rotated image with bilinear interpolation or area averaging,
+// a row at a time. The source index and weight of every destination column
+// and row are computed once, when the resizer is configured for a geometry,
+// and the row buffers are kept with them, so resizing another frame of the
+// same geometry neither divides nor allocates.
+//
+// The source region is first demosaiced at full resolution into
+// `resize_source` by the row kernels, a sensor row at a time.
+class Resizer {
+ public:
+  bool Matches(const CameraFrameFormat& fmt) const {
+    const CameraRoi roi = SourceRoi(fmt);
+    return method_ == fmt.resize && dst_w_ == fmt.width &&
+           dst_h_ == fmt.height && preserve_ratio_ == fmt.preserve_ratio &&
+           roi_.x == roi.x && roi_.y == roi.y && roi_.width == roi.width &&
+           roi_.height == roi.height;
+  }
+
+  void Configure(const CameraFrameFormat& fmt) {
+    method_ = fmt.resize;
+    dst_w_ = fmt.width;
+    dst_h_ = fmt.height;
+    preserve_ratio_ = fmt.preserve_ratio;
+    roi_ = SourceRoi(fmt);
+    ScaledSize(fmt, &scaled_w_, &scaled_h_);
+    if (method_ == CameraResizeMethod::kArea) {
+      BuildAreaTaps(roi_.width, scaled_w_, &x_taps_);
+      BuildAreaTaps(roi_.height, scaled_h_, &y_taps_);
+      int max_count = 0;
+      for (const Tap& tap : x_taps_) {
+        max_count = std::max<int>(max_count, tap.weight);
+      }
+      reciprocals_.resize(max_count + 1);
+      sums_.resize(scaled_w_ * 3);
+    } else {
+      BuildBilinearTaps(roi_.width, scaled_w_, &x_taps_);
+      BuildBilinearTaps(roi_.height, scaled_h_, &y_taps_);
+      for (auto& row : rows_) row.resize(scaled_w_ * 3);
+    }
+  }
+
+  void Resize(const uint8_t* camera_raw, const CameraFrameFormat& fmt,
+              const WhiteBalanceGains* gains) {
+    Demosaic(camera_raw, fmt);
+    if (method_ == CameraResizeMethod::kArea) {
+      ResizeArea(fmt, gains);
+    } else {
+      ResizeBilinear(fmt, gains);
+    }
+  }
+
+ private:
+  // Bilinear: the first of the two source pixels, and the weight of the
+  // second in 1/256ths. Area: the first source pixel and the pixel count.
+  struct Tap {
+    uint16_t index;
+    uint16_t weight;
+  };
+
+  // Samples at pixel centers, so edges don't shift. The first index is kept
+  // below `src - 1` so the second pixel is always in bounds.
+  static void BuildBilinearTaps(int src, int dst, std::vector<Tap>* taps) {
+    taps->resize(dst);
+    for (int d = 0; d < dst; ++d) {
+      // Source position in 1/256ths: (d + 0.5) * src / dst - 0.5.
+      int pos = ((2 * d + 1) * src * 256 / dst - 256) / 2;
+      pos = std::max(0, std::min(pos, (src - 1) * 256));
+      int index = std::min(pos >> 8, src - 2);
+      (*taps)[d] = {static_cast<uint16_t>(index),
+                    static_cast<uint16_t>(pos - index * 256)};
+    }
+  }
+
+  // Splits the source into `dst` runs of whole pixels. When upscaling, runs
+  // are one pixel and repeat, as with nearest-neighbor.
+  static void BuildAreaTaps(int src, int dst, std::vector<Tap>* taps) {
+    taps->resize(dst);
+    for (int d = 0; d < dst; ++d) {
+      int begin = std::min(d * src / dst, src - 1);
+      int end = std::max(begin + 1, (d + 1) * src / dst);
+      (*taps)[d] = {static_cast<uint16_t>(begin),
+                    static_cast<uint16_t>(end - begin)};
+    }
+  }
+
+  // Demosaics the source region into `resize_source`. The sensor rows it
+  // is rotated from go through the row kernels; the few pixels they leave
+  // out, within `kBorder` of the image edges, are demosaiced one at a time.
+  void Demosaic(const uint8_t* camera_raw, const CameraFrameFormat& fmt) {
+    constexpr int kW = CameraTask::kWidth;
+    constexpr int kH = CameraTask::kHeight;
+    constexpr int kBorder = 3;
+    const int roi_right = roi_.x + roi_.width;
+    const int roi_bottom = roi_.y + roi_.height;
+    int x0, y0, x1, y1;
+    UnrotateXY(fmt.rotation, roi_.x, roi_.y, &x0, &y0);
+    UnrotateXY(fmt.rotation, roi_right - 1, roi_bottom - 1, &x1, &y1);
+    const int first = std::max(std::min(y0, y1), 2);
+    const int last = std::min(std::max(y0, y1), kH - 3);
+    const int x_begin = std::max(std::min(x0, x1), 1);
+    const int x_end = std::min(std::max(x0, x1) + 1, kW - 1);
+    for (int y = first; y <= last; ++y) {
+      const RowTarget target = RotatedRow(fmt.rotation, kW, y);
+      uint8_t* dst = &resize_source[0][0] + target.offset * 3;
+      const int step = target.step * 3;
+      auto out = [dst, step](int x, uint8_t r, uint8_t g, uint8_t b) {
+        uint8_t* p = dst + x * step;
+        p[0] = r;
+        p[1] = g;
+        p[2] = b;
+      };
+      if (fmt.filter == CameraFilterMethod::kBinning) {
+        // Binning reads a single quad, so it needs no kernel of its own.
+        for (int x = x_begin; x < x_end; ++x) {
+          uint8_t r, g, b;
+          DemosaicPixel(camera_raw, kW, kH, x, y, fmt.filter, &r, &g, &b);
+          out(x, r, g, b);
+        }
+      } else {
+        DemosaicRow(camera_raw, kW, kH, y, fmt.filter, out, x_begin, x_end);
+      }
+    }
+
+    for (int v = roi_.y; v < roi_bottom; ++v) {
+      const bool edge_row = v < kBorder || v >= kH - kBorder;
+      for (int u = roi_.x; u < roi_right; ++u) {
+        if (!edge_row && u >= kBorder && u < kW - kBorder) {
+          u = kW - kBorder;
+          if (u >= roi_right) break;
+        }
+        int x, y;
+        UnrotateXY(fmt.rotation, u, v, &x, &y);
+        if (RowKernelCovers(fmt.filter, x, y)) continue;
+        uint8_t* p = resize_source[v] + u * 3;
+        DemosaicPixel(camera_raw, kW, kH, x, y, fmt.filter, &p[0], &p[1],
+                      &p[2]);
+      }
+    }
+  }
+
+  // Gets row `v` of the source region.
+  const uint8_t* SourceRow(int v) const {
+    return resize_source[roi_.y + v] + roi_.x * 3;
+  }
+
+  // Writes one scaled pixel and returns the next destination.
+  static uint8_t* Store(uint8_t* dst, uint8_t r, uint8_t g, uint8_t b,
+                        bool rgb, const WhiteBalanceGains* gains) {
+    if (gains) {
+      r = ApplyGain(r, gains->r);
+      g = ApplyGain(g, gains->g);
+      b = ApplyGain(b, gains->b);
+    }
+    if (rgb) {
+      *dst++ = r;
+      *dst++ = g;
+      *dst++ = b;
+    } else {
+      *dst++ = Luma(r, g, b);
+    }
+    return dst;
+  }
+
+  // Interpolates source row `v` horizontally into `row`, in 8.8 fixed point.
+  void ResizeRow(int v, uint16_t* row) {
+    const uint8_t* src = SourceRow(v);
+    for (const Tap& tap : x_taps_) {
+      const uint8_t* p0 = src + tap.index * 3;
+      const uint8_t* p1 = p0 + 3;
+      const int w1 = tap.weight;
+      const int w0 = 256 - w1;
+      *row++ = p0[0] * w0 + p1[0] * w1;
+      *row++ = p0[1] * w0 + p1[1] * w1;
+      *row++ = p0[2] * w0 + p1[2] * w1;
     }
-    r_sum += r;
-    g_sum += g;
-    b_sum += b;
-  }
-  r_sum_f = static_cast<float>(r_sum);
-  g_sum_f = static_cast<float>(g_sum);
-  b_sum_f = static_cast<float>(b_sum);
-  float max_channel = std::max(r_sum_f, std::max(g_sum_f, b_sum_f));
-  float epsilon = 0.1;
-  float r_gain_f = r_sum_f < epsilon ? 0.0f : max_channel / r_sum_f;
-  float g_gain_f = g_sum_f < epsilon ? 0.0f : max_channel / g_sum_f;
-  float b_gain_f = b_sum_f < epsilon ? 0.0f : max_channel / b_sum_f;
-  uint16_t r_gain_i = static_cast<uint16_t>(r_gain_f * (1 << 8));
-  uint16_t g_gain_i = static_cast<uint16_t>(g_gain_f * (1 << 8));
-  uint16_t b_gain_i = static_cast<uint16_t>(b_gain_f * (1 << 8));
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    camera_rgb[i * 3 + 0] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(r) * r_gain_i) >> 8));
-    camera_rgb[i * 3 + 1] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(g) * g_gain_i) >> 8));
-    camera_rgb[i * 3 + 2] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(b) * b_gain_i) >> 8));
   }
+
+  void ResizeBilinear(const CameraFrameFormat& fmt,
+                      const WhiteBalanceGains* gains) {
+    const bool rgb = fmt.fmt == CameraFormat::kRgb;
+    const int bpp = CameraFormatBpp(fmt.fmt);
+    // Adjacent destination rows mostly share source rows; keep the last two.
+    int loaded[2] = {-1, -1};
+    uint8_t* dst = fmt.buffer;
+    for (int y = 0; y < scaled_h_; ++y) {
+      const Tap& tap = y_taps_[y];
+      if (loaded[0] != tap.index) {
+        if (loaded[1] == tap.index) {
+          std::swap(rows_[0], rows_[1]);
+          loaded[0] = loaded[1];
+        } else {
+          ResizeRow(tap.index, rows_[0].data());
+          loaded[0] = tap.index;
+        }
+        loaded[1] = -1;
+      }
+      if (loaded[1] != tap.index + 1) {
+        ResizeRow(tap.index + 1, rows_[1].data());
+        loaded[1] = tap.index + 1;
+      }
+      const uint32_t w1 = tap.weight;
+      const uint32_t w0 = 256 - w1;
+      const uint16_t* top = rows_[0].data();
+      const uint16_t* bottom = rows_[1].data();
+      for (int x = 0; x < scaled_w_; ++x, top += 3, bottom += 3) {
+        uint8_t rgb_out[3];
+        for (int c = 0; c < 3; ++c) {
+          rgb_out[c] = (top[c] * w0 + bottom[c] * w1 + (1 << 15)) >> 16;
+        }
+        dst = Store(dst, rgb_out[0], rgb_out[1], rgb_out[2], rgb, gains);
+      }
+      std::memset(dst, 0, (dst_w_ - scaled_w_) * bpp);
+      dst += (dst_w_ - scaled_w_) * bpp;
+    }
+    std::memset(dst, 0, (dst_h_ - scaled_h_) * dst_w_ * bpp);
+  }
+
+  void ResizeArea(const CameraFrameFormat& fmt,
+                  const WhiteBalanceGains* gains) {
+    const bool rgb = fmt.fmt == CameraFormat::kRgb;
+    const int bpp = CameraFormatBpp(fmt.fmt);
+    uint8_t* dst = fmt.buffer;
+    for (int y = 0; y < scaled_h_; ++y) {
+      const Tap& y_tap = y_taps_[y];
+      std::fill(sums_.begin(), sums_.end(), 0);
+      for (int v = y_tap.index; v < y_tap.index + y_tap.weight; ++v) {
+        const uint8_t* src = SourceRow(v);
+        uint32_t* sum = sums_.data();
+        for (const Tap& x_tap : x_taps_) {
+          const uint8_t* p = src + x_tap.index * 3;
+          for (int i = 0; i < x_tap.weight; ++i, p += 3) {
+            sum[0] += p[0];
+            sum[1] += p[1];
+            sum[2] += p[2];
+          }
+          sum += 3;
+        }
+      }
+      // Dividing by the box area becomes a multiply by its reciprocal in
+      // 8.24 fixed point; the row height is fixed, so only the few column
+      // widths need one.
+      for (size_t count = 1; count < reciprocals_.size(); ++count) {
+        const uint32_t area = count * y_tap.weight;
+        reciprocals_[count] = ((1u << 24) + area / 2) / area;
+      }
+      const uint32_t* sum = sums_.data();
+      for (const Tap& x_tap : x_taps_) {
+        const uint64_t reciprocal = reciprocals_[x_tap.weight];
+        uint8_t rgb_out[3];
+        for (int c = 0; c < 3; ++c) {
+          rgb_out[c] = std::min<uint64_t>(
+              (sum[c] * reciprocal + (1u << 23)) >> 24, 255);
+        }
+        dst = Store(dst, rgb_out[0], rgb_out[1], rgb_out[2], rgb, gains);
+        sum += 3;
+      }
+      std::memset(dst, 0, (dst_w_ - scaled_w_) * bpp);
+      dst += (dst_w_ - scaled_w_) * bpp;
+    }
+    std::memset(dst, 0, (dst_h_ - scaled_h_) * dst_w_ * bpp);
+  }
+
+  CameraResizeMethod method_ = CameraResizeMethod::kNearestNeighbor;
+  int dst_w_ = 0;
+  int dst_h_ = 0;
+  bool preserve_ratio_ = false;
+  CameraRoi roi_;
+  int scaled_w_ = 0;
+  int scaled_h_ = 0;
+  std::vector<Tap> x_taps_;
+  std::vector<Tap> y_taps_;
+  std::vector<uint16_t> rows_[2];
+  std::vector<uint32_t> sums_;
+  std::vector<uint32_t> reciprocals_;
+};
+
+// Resizers for the most recently used geometries, replaced round robin.
+// Guarded by `CameraTask::resize_mutex_`.
+constexpr int kResizerCount = 4;
+Resizer g_resizers[kResizerCount];
+int g_next_resizer = 0;
+
+Resizer* GetResizer(const CameraFrameFormat& fmt) {
+  for (Resizer& resizer : g_resizers) {
+    if (resizer.Matches(fmt)) return &resizer;
+  }
+  Resizer* resizer = &g_resizers[g_next_resizer];
+  g_next_resizer = (g_next_resizer + 1) % kResizerCount;
+  resizer->Configure(fmt);
+  return resizer;
 }
 }  // namespace
 
@@ -462,6 +920,31 @@ extern "C" void CSI_IRQHandler(void) {
   __DSB();
 }
 
+CameraRoi CameraZoomRoi(float zoom) {
+  zoom = std::max(zoom, 1.0f);
+  CameraRoi roi;
+  roi.width = std::max(2, static_cast<int>(CameraTask::kWidth / zoom));
+  roi.height = std::max(2, static_cast<int>(CameraTask::kHeight / zoom));
+  roi.x = (static_cast<int>(CameraTask::kWidth) - roi.width) / 2;
+  roi.y = (static_cast<int>(CameraTask::kHeight) - roi.height) / 2;
+  return roi;
+}
+
+bool CameraFrameFormatValid(const CameraFrameFormat& fmt) {
+  constexpr int kWidth = CameraTask::kWidth;
+  constexpr int kHeight = CameraTask::kHeight;
+  if (!fmt.buffer || fmt.width <= 0 || fmt.height <= 0) {
+    return false;
+  }
+  const CameraRoi& roi = fmt.roi;
+  if (fmt.fmt == CameraFormat::kRaw) {
+    return fmt.width == kWidth && fmt.height == kHeight && IsFullFrame(roi);
+  }
+  return IsFullFrame(roi) ||
+         (roi.x >= 0 && roi.y >= 0 && roi.width >= 2 && roi.height >= 2 &&
+          roi.x + roi.width <= kWidth && roi.y + roi.height <= kHeight);
+}
+
 int CameraFormatBpp(CameraFormat fmt) {
   switch (fmt) {
     case CameraFormat::kRgb:
@@ -473,7 +956,65 @@ int CameraFormatBpp(CameraFormat fmt) {
   return 0;
 }
 
-bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
+CameraFrameLease::~CameraFrameLease() { Release(); }
+
+CameraFrameLease::CameraFrameLease(const CameraFrameLease& other)
+    : index_(other.index_),
+      data_(other.data_),
+      sequence_(other.sequence_),
+      timestamp_us_(other.timestamp_us_) {
+  if (valid()) {
+    CameraTask::GetSingleton()->RetainFrame(index_);
+  }
+}
+
+CameraFrameLease& CameraFrameLease::operator=(const CameraFrameLease& other) {
+  if (this != &other) {
+    // Retain first, in case both leases hold the same frame.
+    if (other.valid()) {
+      CameraTask::GetSingleton()->RetainFrame(other.index_);
+    }
+    Release();
+    index_ = other.index_;
+    data_ = other.data_;
+    sequence_ = other.sequence_;
+    timestamp_us_ = other.timestamp_us_;
+  }
+  return *this;
+}
+
+CameraFrameLease::CameraFrameLease(CameraFrameLease&& other)
+    : index_(other.index_),
+      data_(other.data_),
+      sequence_(other.sequence_),
+      timestamp_us_(other.timestamp_us_) {
+  other.index_ = -1;
+  other.data_ = nullptr;
+}
+
+CameraFrameLease& CameraFrameLease::operator=(CameraFrameLease&& other) {
+  if (this != &other) {
+    Release();
+    index_ = other.index_;
+    data_ = other.data_;
+    sequence_ = other.sequence_;
+    timestamp_us_ = other.timestamp_us_;
+    other.index_ = -1;
+    other.data_ = nullptr;
+  }
+  return *this;
+}
+
+void CameraFrameLease::Release() {
+  if (valid()) {
+    CameraTask::GetSingleton()->ReleaseFrame(index_);
+  }
+  index_ = -1;
+  data_ = nullptr;
+}
+
+bool CameraTask::LeaseFrame(CameraFrameLease* lease) {
+  lease->Release();
   if (!enabled_) {
     printf("Camera is not enabled, cannot capture frame.\r\n");
     return false;
@@ -483,7 +1024,6 @@ bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
     return false;
   }
 
-  bool ret = true;
   uint8_t* raw = nullptr;
   int index = GetFrame(&raw, true);
   if (!raw) {
@@ -492,56 +1032,191 @@ bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
   if (mode_ == CameraMode::kTrigger) {
     GpioSet(Gpio::kCameraTrigger, false);
   }
+  {
+    MutexLock lock(lease_mutex_);
+    lease_counts_[index] = 1;
+  }
+  lease->index_ = index;
+  lease->data_ = raw;
+  lease->sequence_ = frame_info_[index].sequence;
+  lease->timestamp_us_ = frame_info_[index].timestamp_us;
+  return true;
+}
+
+bool CameraTask::GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                               CameraFrameCallback callback) {
+  if (!enabled_) {
+    printf("Camera is not enabled, cannot capture frame.\r\n");
+    return false;
+  }
+  {
+    MutexLock lock(pipeline_mutex_);
+    if (!pipeline_task_) {
+      pipeline_free_ = xQueueCreate(kPipelineDepth, sizeof(int));
+      CHECK(pipeline_free_);
+      pipeline_pending_ = xQueueCreate(kPipelineDepth, sizeof(int));
+      CHECK(pipeline_pending_);
+      for (int i = 0; i < kPipelineDepth; ++i) {
+        CHECK(xQueueSendToBack(pipeline_free_, &i, portMAX_DELAY) == pdTRUE);
+      }
+      CHECK(xTaskCreate(StaticPipelineMain, "camera_pipeline",
+                        configMINIMAL_STACK_SIZE * 10, this,
+                        kCameraPipelineTaskPriority,
+                        &pipeline_task_) == pdPASS);
+    }
+  }
+
+  int index;
+  CHECK(xQueueReceive(pipeline_free_, &index, portMAX_DELAY) == pdTRUE);
+  pipeline_jobs_[index].fmts = fmts;
+  pipeline_jobs_[index].callback = std::move(callback);
+  CHECK(xQueueSendToBack(pipeline_pending_, &index, portMAX_DELAY) == pdTRUE);
+  return true;
+}
+
+void CameraTask::StaticPipelineMain(void* param) {
+  static_cast<CameraTask*>(param)->PipelineMain();
+}
+
+void CameraTask::PipelineMain() {
+  CameraFrameLease lease;
+  while (true) {
+    int index;
+    CHECK(xQueueReceive(pipeline_pending_, &index, portMAX_DELAY) == pdTRUE);
+    PipelineJob& job = pipeline_jobs_[index];
+    CameraFrameResult result{false, 0, 0};
+    if (LeaseFrame(&lease)) {
+      result.success = ConvertFrame(lease, job.fmts);
+      result.sequence = lease.sequence();
+      result.timestamp_us = lease.timestamp_us();
+      lease.Release();
+    }
+    // Free the job before calling back, so the callback can queue the next.
+    CameraFrameCallback callback = std::move(job.callback);
+    job.callback = nullptr;
+    CHECK(xQueueSendToBack(pipeline_free_, &index, portMAX_DELAY) == pdTRUE);
+    if (callback) {
+      callback(result);
+    }
+  }
+}
+
+void CameraTask::StaticCsiCallback(CSI_Type* base, csi_handle_t* handle,
+                                   status_t status, void* user_data) {
+  if (status != kStatus_CSI_FrameDone) {
+    return;
+  }
+  // The driver has just put the completed buffer at the back of its full
+  // buffer queue.
+  constexpr int kQueueSize = sizeof(handle->frameBufferQueue) /
+                             sizeof(handle->frameBufferQueue[0]);
+  const uint32_t buffer =
+      handle->frameBufferQueue[(handle->queueWriteIdx + kQueueSize - 1) %
+                               kQueueSize];
+  const int index =
+      FramebufferPtrToIndex(reinterpret_cast<const uint8_t*>(buffer));
+  if (index != -1) {
+    static_cast<CameraTask*>(user_data)->capture_times_[index] = TimerMicros();
+  }
+}
+
+void CameraTask::RetainFrame(int index) {
+  MutexLock lock(lease_mutex_);
+  ++lease_counts_[index];
+}
+
+void CameraTask::ReleaseFrame(int index) {
+  bool submit;
+  {
+    MutexLock lock(lease_mutex_);
+    submit =
+        --lease_counts_[index] == 0 && index < active_framebuffer_count_;
+  }
+  if (submit) {
+    ReturnFrame(index);
+  }
+}
+
+bool CameraTask::SetFramebufferCount(int count) {
+  if (count < 2 || count > kMaxFramebufferCount) {
+    return false;
+  }
+  framebuffer_count_ = count;
+  return true;
+}
+
+bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
+  CameraFrameLease lease;
+  if (!LeaseFrame(&lease)) {
+    return false;
+  }
+  return ConvertFrame(lease, fmts);
+}
+
+bool CameraTask::ConvertFrame(const CameraFrameLease& lease,
+                              const std::vector<CameraFrameFormat>& fmts) {
+  if (!lease.valid()) {
+    return false;
+  }
+  const uint8_t* raw = lease.data();
+
+  bool ret = true;
+
+  // White balance statistics are gathered once per frame, however many
+  // formats use them.
+  WhiteBalanceGains gains;
+  bool gains_ready = false;
+  auto white_balance = [&](const CameraFrameFormat& fmt)
+      -> const WhiteBalanceGains* {
+    if (!fmt.white_balance ||
+        GetSingleton()->test_pattern_ != CameraTestPattern::kNone) {
+      return nullptr;
+    }
+    if (!gains_ready) {
+      uint16_t smoothed[3];
+      UpdateWhiteBalance(raw, smoothed);
+      gains = {smoothed[0], smoothed[1], smoothed[2]};
+      gains_ready = true;
+    }
+    return &gains;
+  };
+  auto scale = [&](const CameraFrameFormat& fmt,
+                   const WhiteBalanceGains* gains) {
+    if (fmt.resize == CameraResizeMethod::kNearestNeighbor) {
+      BayerToScaled(raw, fmt, gains);
+      return;
+    }
+    MutexLock lock(resize_mutex_);
+    GetResizer(fmt)->Resize(raw, fmt, gains);
+  };
 
   for (const CameraFrameFormat& fmt : fmts) {
+    if (!CameraFrameFormatValid(fmt)) {
+      ret = false;
+      continue;
+    }
+    // Native size images of the whole frame need no resampling.
+    const bool native = fmt.width == kWidth && fmt.height == kHeight &&
+                        IsFullFrame(fmt.roi) &&
+                        fmt.filter != CameraFilterMethod::kBinning;
     switch (fmt.fmt) {
       case CameraFormat::kRgb: {
-        if (fmt.width == kWidth && fmt.height == kHeight) {
+        if (native) {
           BayerToRgb(raw, fmt.buffer, fmt.width, fmt.height, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(fmt.buffer, fmt.width, fmt.height);
-          }
+                     fmt.rotation, white_balance(fmt));
         } else {
-          auto buffer_rgb = std::make_unique<uint8_t[]>(
-              CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-          BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(buffer_rgb.get(), kWidth, kHeight);
-          }
-          ResizeNearestNeighbor(buffer_rgb.get(), kWidth, kHeight, fmt.buffer,
-                                fmt.width, fmt.height,
-                                CameraFormatBpp(CameraFormat::kRgb),
-                                fmt.preserve_ratio);
+          scale(fmt, white_balance(fmt));
         }
         break;
         case CameraFormat::kY8: {
-          if (fmt.width == kWidth && fmt.height == kHeight) {
+          if (native) {
             BayerToGrayscale(raw, fmt.buffer, kWidth, kHeight, fmt.filter,
                              fmt.rotation);
           } else {
-            auto buffer_rgb = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-            auto buffer_rgb_scaled = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * fmt.width * fmt.height);
-            BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                       fmt.rotation);
-            ResizeNearestNeighbor(
-                buffer_rgb.get(), kWidth, kHeight, buffer_rgb_scaled.get(),
-                fmt.width, fmt.height, CameraFormatBpp(CameraFormat::kRgb),
-                fmt.preserve_ratio);
-            RgbToGrayscale(buffer_rgb_scaled.get(), fmt.buffer, fmt.width,
-                           fmt.height);
+            scale(fmt, nullptr);
           }
         } break;
         case CameraFormat::kRaw:
-          if (fmt.width != kWidth || fmt.height != kHeight) {
-            ret = false;
-            break;
-          }
           std::memcpy(fmt.buffer, raw,
                       kWidth * kHeight * CameraFormatBpp(CameraFormat::kRaw));
           ret = true;
@@ -552,10 +1227,51 @@ bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
     }
   }
 
-  GetSingleton()->ReturnFrame(index);
   return ret;
 }
 
+void CameraTask::UpdateWhiteBalance(const uint8_t* raw, uint16_t gains[3]) {
+  // Gains move a quarter of the way to each new estimate, and are converged
+  // once every estimate is within 1/64 of them.
+  constexpr int kSmoothingShift = 2;
+  constexpr int32_t kConvergedThreshold = 1 << 10;
+  const WhiteBalanceGains estimate =
+      BayerWhiteBalanceGains(raw, kWidth, kHeight);
+  const int32_t targets[3] = {estimate.r << 8, estimate.g << 8,
+                              estimate.b << 8};
+
+  MutexLock lock(awb_mutex_);
+  bool converged = true;
+  for (int i = 0; i < 3; ++i) {
+    if (!awb_started_) {
+      awb_gains_[i] = targets[i];
+    } else {
+      const int32_t error = targets[i] - awb_gains_[i];
+      awb_gains_[i] += error / (1 << kSmoothingShift);
+      converged &= std::abs(error) <= kConvergedThreshold;
+    }
+    gains[i] = static_cast<uint16_t>(awb_gains_[i] >> 8);
+  }
+  awb_converged_ = awb_started_ && converged;
+  awb_started_ = true;
+}
+
+CameraWhiteBalance CameraTask::GetWhiteBalance() {
+  MutexLock lock(awb_mutex_);
+  if (!awb_started_) {
+    return {1.0f, 1.0f, 1.0f, false};
+  }
+  constexpr float kScale = 1.0f / (1 << 16);
+  return {awb_gains_[0] * kScale, awb_gains_[1] * kScale,
+          awb_gains_[2] * kScale, awb_converged_};
+}
+
+void CameraTask::ResetWhiteBalance() {
+  MutexLock lock(awb_mutex_);
+  awb_started_ = false;
+  awb_converged_ = false;
+}
+
 bool CameraTask::Read(uint16_t reg, uint8_t* val) {
   lpi2c_master_transfer_t transfer;
   transfer.flags = kLPI2C_TransferDefaultFlag;
@@ -584,6 +1300,14 @@ bool CameraTask::Write(uint16_t reg, uint8_t val) {
 
 void CameraTask::Init(lpi2c_rtos_handle_t* i2c_handle) {
   QueueTask::Init();
+  awb_mutex_ = xSemaphoreCreateMutex();
+  CHECK(awb_mutex_);
+  resize_mutex_ = xSemaphoreCreateMutex();
+  CHECK(resize_mutex_);
+  lease_mutex_ = xSemaphoreCreateMutex();
+  CHECK(lease_mutex_);
+  pipeline_mutex_ = xSemaphoreCreateMutex();
+  CHECK(pipeline_mutex_);
   i2c_handle_ = i2c_handle;
   enabled_ = false;
   GetMotionDetectionConfigDefault(md_config_);
@@ -754,6 +1478,27 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   camera::EnableResponse resp;
   status_t status;
 
+  int framebuffer_count = framebuffer_count_;
+  if (mode == CameraMode::kTrigger) {
+    framebuffer_count = 2;
+  }
+  // The CSI needs two framebuffers to capture into; the rest are submitted
+  // as their leases are released.
+  {
+    MutexLock lock(lease_mutex_);
+    int free_count = 0;
+    for (int i = 0; i < framebuffer_count; ++i) {
+      if (lease_counts_[i] == 0) ++free_count;
+    }
+    if (free_count < 2) {
+      printf("Camera needs 2 free framebuffers to start, but %d of %d are "
+             "leased\r\n",
+             framebuffer_count - free_count, framebuffer_count);
+      resp.success = false;
+      return resp;
+    }
+  }
+
   // Gated clock mode
   uint8_t osc_clk_div;
   Read(CameraRegisters::kOscClkDiv, &osc_clk_div);
@@ -765,15 +1510,19 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   // Shifting
   Write(CameraRegisters::kVsyncHsyncPixelShiftEn, 0x0);
 
-  status = CSI_TransferCreateHandle(CSI, &csi_handle_, nullptr, 0);
+  status = CSI_TransferCreateHandle(CSI, &csi_handle_, StaticCsiCallback, this);
 
-  int framebuffer_count = kFramebufferCount;
-  if (mode == CameraMode::kTrigger) {
-    framebuffer_count = 2;
-  }
-  for (int i = 0; i < framebuffer_count; i++) {
-    status = CSI_TransferSubmitEmptyBuffer(
-        CSI, &csi_handle_, reinterpret_cast<uint32_t>(framebuffers[i]));
+  // Framebuffers still leased from before are submitted when released.
+  {
+    MutexLock lock(lease_mutex_);
+    active_framebuffer_count_ = framebuffer_count;
+    for (int i = 0; i < framebuffer_count; i++) {
+      if (lease_counts_[i] > 0) {
+        continue;
+      }
+      status = CSI_TransferSubmitEmptyBuffer(
+          CSI, &csi_handle_, reinterpret_cast<uint32_t>(framebuffers[i]));
+    }
   }
 
   // Streaming
@@ -785,6 +1534,10 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
 
 void CameraTask::HandleDisableRequest() {
   enabled_ = false;
+  {
+    MutexLock lock(lease_mutex_);
+    active_framebuffer_count_ = 0;
+  }
   Write(CameraRegisters::kModeSelect, 0);
   CSI_TransferStop(CSI, &csi_handle_);
 }
@@ -827,6 +1580,9 @@ camera::FrameResponse CameraTask::HandleFrameRequest(
     if (status == kStatus_Success) {
       DCACHE_InvalidateByRange(buffer, kHeight * kWidth);
       resp.index = FramebufferPtrToIndex(reinterpret_cast<uint8_t*>(buffer));
+      if (resp.index != -1) {
+        frame_info_[resp.index] = {++sequence_, capture_times_[resp.index]};
+      }
     }
   } else {  // RETURN
     buffer = reinterpret_cast<uint32_t>(IndexToFramebufferPtr(frame.index));
@@ -175,6 +175,26 @@ int CameraFormatBpp(CameraFormat fmt);
 enum class CameraFilterMethod {
   kBilinear,
   kNearestNeighbor,
+  // Takes each output pixel from the 2x2 raw block that holds it, instead of
+  // interpolating neighbors. The cheapest method. Only that block is read,
+  // so below half the native size the pixels between blocks are skipped and
+  // it aliases like nearest-neighbor; use `CameraResizeMethod::kArea` to
+  // average everything each output pixel covers.
+  kBinning,
+};
+
+// Image resizing method (when the width or height differ from the native
+// size). Scaling is done in fixed point, from coefficients computed once for
+// each output size.
+enum class CameraResizeMethod {
+  // Picks the nearest source pixel. The fastest method.
+  kNearestNeighbor,
+  // Interpolates between the four nearest source pixels. Best for small
+  // changes in size.
+  kBilinear,
+  // Averages every source pixel covered by each output pixel. Best for
+  // downscaling, where it avoids aliasing; it upscales as nearest-neighbor.
+  kArea,
 };
 
 // Clockwise image rotations.
@@ -191,6 +211,25 @@ enum class CameraRotation {
   k270,
 };
 
+// A rectangle of the native image, in pixels, after rotation (as seen in the
+// output image). Used with `CameraFrameFormat::roi`.
+struct CameraRoi {
+  // Left-most column.
+  int x = 0;
+  // Top-most row.
+  int y = 0;
+  // Width, or 0 for the whole image.
+  int width = 0;
+  // Height, or 0 for the whole image.
+  int height = 0;
+};
+
+// Gets the region for a digital zoom: the centered part of the native image
+// that, scaled to the native size, magnifies it by `zoom`.
+// @param zoom The magnification, 1 or more.
+// @return The region to set as `CameraFrameFormat::roi`.
+CameraRoi CameraZoomRoi(float zoom);
+
 // Specifies your image buffer location and any image processing you want to
 // perform when fetching images with `CameraTask::GetFrame()`.
 struct CameraFrameFormat {
@@ -212,8 +251,89 @@ struct CameraFrameFormat {
   uint8_t* buffer;
   // Set true to perform auto whitebalancing (default), false to disable it.
   bool white_balance = true;
+  // Resize method such as nearest-neighbor (default) or area averaging.
+  CameraResizeMethod resize = CameraResizeMethod::kNearestNeighbor;
+  // Region of the image to process and scale to `width` by `height`, such as
+  // a detected object; the default is the whole image. Only the region is
+  // demosaiced, so a small region costs less. It must be at least 2x2 and lie
+  // within the native image, and can't be used with `CameraFormat::kRaw`.
+  CameraRoi roi;
+};
+
+// Checks that an image can be produced in a format: it has a buffer and a
+// size, its region of interest lies within the native image, and raw images
+// are native size with no region. `CameraTask::GetFrame()` fails for formats
+// that don't pass.
+// @param fmt The format to check.
+// @return True if the format is valid, false otherwise.
+bool CameraFrameFormatValid(const CameraFrameFormat& fmt);
+
+// The state of auto white balancing, from `CameraTask::GetWhiteBalance()`.
+struct CameraWhiteBalance {
+  // Gain applied to each color channel; 1 leaves a channel unchanged.
+  float red_gain;
+  float green_gain;
+  float blue_gain;
+  // Whether the gains have settled for the current scene.
+  bool converged;
+};
+
+// A read-only reference to a raw frame, from `CameraTask::LeaseFrame()`.
+//
+// The frame is read in place: it stays in the camera framebuffer, which is
+// not given back to the camera until the lease and every copy of it have
+// been released or destroyed. While a lease is held the camera has one
+// framebuffer fewer to capture into, so release leases promptly.
+class CameraFrameLease {
+ public:
+  CameraFrameLease() = default;
+  ~CameraFrameLease();
+  CameraFrameLease(const CameraFrameLease& other);
+  CameraFrameLease& operator=(const CameraFrameLease& other);
+  CameraFrameLease(CameraFrameLease&& other);
+  CameraFrameLease& operator=(CameraFrameLease&& other);
+
+  // Drops this reference to the frame. The framebuffer returns to the camera
+  // once the last reference is dropped.
+  void Release();
+
+  // Whether this lease holds a frame.
+  bool valid() const { return index_ >= 0; }
+
+  // The raw Bayer image, `CameraTask::kWidth` by `CameraTask::kHeight` bytes.
+  const uint8_t* data() const { return data_; }
+
+  // Counts every frame captured by the camera (including discarded frames),
+  // so a gap between leases shows how many frames were skipped.
+  uint32_t sequence() const { return sequence_; }
+
+  // When the camera finished capturing the frame, in microseconds since boot
+  // (as from `TimerMicros()`). This is taken in the CSI frame interrupt, so
+  // it doesn't include any time the frame then waited to be fetched.
+  uint64_t timestamp_us() const { return timestamp_us_; }
+
+ private:
+  friend class CameraTask;
+  int index_ = -1;
+  const uint8_t* data_ = nullptr;
+  uint32_t sequence_ = 0;
+  uint64_t timestamp_us_ = 0;
+};
+
+// The outcome of a capture requested with `CameraTask::GetFrameAsync()`.
+struct CameraFrameResult {
+  // True if the frame was captured and processed into every format.
+  bool success;
+  // The frame's `CameraFrameLease::sequence()`.
+  uint32_t sequence;
+  // The frame's `CameraFrameLease::timestamp_us()`. Subtract this from the
+  // time a result is ready to get the latency since capture.
+  uint64_t timestamp_us;
 };
 
+// The function type that receives the result of `CameraTask::GetFrameAsync()`.
+using CameraFrameCallback = std::function<void(const CameraFrameResult&)>;
+
 // Provides access to the Dev Board Micro camera.
 //
 // You can access the shared camera object with `CameraTask::GetSingleton()`.
@@ -270,6 +390,53 @@ class CameraTask
   // @return True if image processing succeeds, false otherwise.
   bool GetFrame(const std::vector<CameraFrameFormat>& fmts);
 
+  // Gets one frame from the camera buffer and processes it into one or more
+  // formats in the background, like `GetFrame()` but without blocking.
+  //
+  // Requests are handled in order by a camera pipeline task, so you can
+  // request the next frame and run inference on the current one while the
+  // next is captured and processed. Use a different buffer for each request
+  // in flight. If `kPipelineDepth` requests are already waiting, this blocks
+  // until one starts.
+  //
+  // @param fmts A list of image formats you want to receive. The buffers must
+  // stay valid until `callback` is called.
+  // @param callback The function to call once the buffers are filled (or the
+  // capture failed). It runs in the pipeline task, so it should return
+  // quickly, for example by sending the result to a queue.
+  // @return True if the request was queued, false if the camera is not
+  // enabled.
+  bool GetFrameAsync(const std::vector<CameraFrameFormat>& fmts,
+                     CameraFrameCallback callback);
+
+  // Gets one frame from the camera buffer without copying or processing it.
+  //
+  // Use this when you read the raw image yourself, such as for your own
+  // image processing, to avoid a copy. It blocks and fails in the same cases
+  // as `GetFrame()`.
+  //
+  // @param lease Set to the frame. The frame is held until the lease is
+  // released.
+  // @return True if a frame was leased, false otherwise.
+  bool LeaseFrame(CameraFrameLease* lease);
+
+  // Processes a leased frame into one or more formats, as `GetFrame()` does.
+  //
+  // @param lease The frame to process, from `LeaseFrame()`.
+  // @param fmts A list of image formats you want to receive.
+  // @return True if image processing succeeds, false otherwise.
+  bool ConvertFrame(const CameraFrameLease& lease,
+                    const std::vector<CameraFrameFormat>& fmts);
+
+  // Sets the number of framebuffers the camera captures into, from the next
+  // `Enable()`. More framebuffers let you hold frame leases for longer without
+  // stalling capture. The default is `kMaxFramebufferCount`. `Enable()` fails
+  // if fewer than two of them are free of leases.
+  //
+  // @param count The number of framebuffers, from 2 to `kMaxFramebufferCount`.
+  // @return True if the count was set, false if it is out of range.
+  bool SetFramebufferCount(int count);
+
   // Turns the camera power on and off. You must call this before `Enable()`.
   // @param enable True to turn the camera on, false to turn it off.
   // @return True if the action was successful, false otherwise.
@@ -297,6 +464,21 @@ class CameraTask
   // begin using images with `GetFrame()`.
   void DiscardFrames(int count);
 
+  // Gets the white balance gains applied to frames fetched with
+  // `CameraFrameFormat::white_balance` set.
+  //
+  // The gains are estimated from a sparse sample of each frame and follow
+  // changes in the scene gradually, so that consecutive frames don't
+  // flicker. They are 1 until the first white balanced frame.
+  //
+  // @return The current gains and whether they have converged.
+  CameraWhiteBalance GetWhiteBalance();
+
+  // Discards the white balance history, so that the next white balanced frame
+  // uses its own gains outright. Call this after a sudden change of scene or
+  // lighting.
+  void ResetWhiteBalance();
+
   // Gets the default configuration for motion detection.
   //
   // @param config The `CameraMotionDetectionConfig` struct to fill with default
@@ -316,9 +498,35 @@ class CameraTask
   // Native image pixel height.
   static constexpr size_t kHeight = 324;
 
+  // Maximum number of framebuffers, set by the CSI driver queue size
+  // (`CSI_DRIVER_QUEUE_SIZE`).
+  static constexpr int kMaxFramebufferCount = CSI_DRIVER_QUEUE_SIZE;
+
+  // Maximum number of `GetFrameAsync()` requests waiting to be handled.
+  static constexpr int kPipelineDepth = 2;
+
  private:
+  friend class CameraFrameLease;
+  // Sequence number and capture time of a frame in a framebuffer.
+  struct FrameInfo {
+    uint32_t sequence;
+    uint64_t timestamp_us;
+  };
+  // A `GetFrameAsync()` request.
+  struct PipelineJob {
+    std::vector<CameraFrameFormat> fmts;
+    CameraFrameCallback callback;
+  };
+  static void StaticCsiCallback(CSI_Type* base, csi_handle_t* handle,
+                                status_t status, void* user_data);
+  static void StaticPipelineMain(void* param);
+  [[noreturn]] void PipelineMain();
+
   int GetFrame(uint8_t** buffer, bool block);
   void ReturnFrame(int index);
+  // Adds and drops references to a leased framebuffer.
+  void RetainFrame(int index);
+  void ReleaseFrame(int index);
   void TaskInit() override;
   void RequestHandler(camera::Request* req) override;
   camera::EnableResponse HandleEnableRequest(const CameraMode& mode);
@@ -334,6 +542,9 @@ class CameraTask
   bool Write(uint16_t reg, uint8_t val);
   void SetDefaultRegisters();
   void SetMotionDetectionRegisters();
+  // Updates the white balance gains with the estimate from `raw`, and gets
+  // the gains to apply to it in 8.8 fixed point.
+  void UpdateWhiteBalance(const uint8_t* raw, uint16_t gains[3]);
 
   lpi2c_rtos_handle_t* i2c_handle_;
   csi_handle_t csi_handle_;
@@ -342,6 +553,35 @@ class CameraTask
   CameraTestPattern test_pattern_;
   CameraMotionDetectionConfig md_config_;
   bool enabled_{false};
+  int framebuffer_count_{kMaxFramebufferCount};
+  // Guards `lease_counts_` and `active_framebuffer_count_`.
+  SemaphoreHandle_t lease_mutex_;
+  int lease_counts_[kMaxFramebufferCount] = {};
+  // Framebuffers captured into since the last `Enable()`, or 0 while
+  // disabled. Others are not handed back to the CSI when released.
+  int active_framebuffer_count_{0};
+  // Written by the camera task when it receives a frame.
+  FrameInfo frame_info_[kMaxFramebufferCount] = {};
+  uint32_t sequence_{0};
+  // Capture time of the frame in each framebuffer, written by the CSI
+  // interrupt when the frame completes. The camera task reads it once the
+  // driver hands the buffer back as full, and the buffer isn't captured into
+  // again until it is resubmitted.
+  volatile uint64_t capture_times_[kMaxFramebufferCount] = {};
+  // Guards creating the pipeline task.
+  SemaphoreHandle_t pipeline_mutex_;
+  TaskHandle_t pipeline_task_{nullptr};
+  // Indices of free and of waiting `pipeline_jobs_`.
+  QueueHandle_t pipeline_free_;
+  QueueHandle_t pipeline_pending_;
+  PipelineJob pipeline_jobs_[kPipelineDepth];
+  // Guards the cached resize tables and buffers.
+  SemaphoreHandle_t resize_mutex_;
+  SemaphoreHandle_t awb_mutex_;
+  // Smoothed red, green and blue gains in 16.16 fixed point.
+  int32_t awb_gains_[3];
+  bool awb_started_{false};
+  bool awb_converged_{false};
 };
 
 }  // namespace coralmicro
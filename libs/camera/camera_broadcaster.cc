@@ -0,0 +1,271 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/camera/camera_broadcaster.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+
+namespace coralmicro {
+namespace {
+// Whether two formats produce the same image, whatever their buffers.
+bool SameImage(const CameraFrameFormat& a, const CameraFrameFormat& b) {
+  return a.fmt == b.fmt && a.filter == b.filter && a.rotation == b.rotation &&
+         a.width == b.width && a.height == b.height &&
+         a.preserve_ratio == b.preserve_ratio &&
+         a.white_balance == b.white_balance && a.resize == b.resize &&
+         a.roi.x == b.roi.x && a.roi.y == b.roi.y &&
+         a.roi.width == b.roi.width && a.roi.height == b.roi.height;
+}
+
+int ImageSize(const CameraFrameFormat& fmt) {
+  return fmt.width * fmt.height * CameraFormatBpp(fmt.fmt);
+}
+}  // namespace
+
+struct CameraBroadcaster::Subscriber {
+  Subscriber(int id, const CameraSubscriberConfig& config)
+      : id(id),
+        config(config),
+        interval_us(config.max_fps > 0 ? 1000000 / config.max_fps : 0),
+        ready(xSemaphoreCreateBinary()),
+        filled(xSemaphoreCreateBinary()) {
+    CHECK(ready);
+    CHECK(filled);
+  }
+  ~Subscriber() {
+    vSemaphoreDelete(ready);
+    vSemaphoreDelete(filled);
+  }
+
+  // Whether a frame received at `timestamp_us` keeps to the subscriber's
+  // rate. Frames a little early still count, so that a rate which divides the
+  // camera's isn't rounded down by jitter.
+  bool Due(uint64_t timestamp_us) const {
+    return timestamp_us + interval_us / 4 >= next_due_us;
+  }
+
+  void Delivered(const CameraFrameLease& lease, bool ok) {
+    info = {lease.sequence(), lease.timestamp_us()};
+    converted = ok;
+    next_due_us += interval_us;
+    // Don't make up for frames missed while busy with a burst.
+    if (next_due_us + interval_us / 4 <= lease.timestamp_us()) {
+      next_due_us = lease.timestamp_us() + interval_us;
+    }
+  }
+
+  int id;
+  CameraSubscriberConfig config;
+  uint64_t interval_us;
+  uint64_t next_due_us = 0;
+  // Sequence number and timestamp of the frame in the buffer.
+  CameraFrameInfo info{};
+  // Whether the frame was processed into the buffer.
+  bool converted = false;
+  // Given by the subscriber when its buffer is free for the next frame.
+  SemaphoreHandle_t ready;
+  // Given by the broadcaster when the next frame is in the buffer.
+  SemaphoreHandle_t filled;
+  // Subscriber whose buffer holds the same image for the current frame, or
+  // null if this subscriber's buffer is processed from the frame itself.
+  Subscriber* source = nullptr;
+};
+
+CameraBroadcaster::CameraBroadcaster(int task_priority)
+    : mutex_(xSemaphoreCreateMutex()), wake_(xSemaphoreCreateBinary()) {
+  CHECK(mutex_);
+  CHECK(wake_);
+  CHECK(xTaskCreate(StaticRun, "camera_broadcaster",
+                    configMINIMAL_STACK_SIZE * 10, this, task_priority,
+                    &task_) == pdPASS);
+}
+
+CameraBroadcaster::~CameraBroadcaster() {
+  stop_ = true;
+  xSemaphoreGive(wake_);
+
+  while (eTaskGetState(task_) != eSuspended) taskYIELD();
+  vTaskDelete(task_);
+
+  subscribers_.clear();
+  vSemaphoreDelete(wake_);
+  vSemaphoreDelete(mutex_);
+}
+
+int CameraBroadcaster::Subscribe(const CameraSubscriberConfig& config) {
+  if (!CameraFrameFormatValid(config.fmt) || config.max_fps < 0) {
+    return -1;
+  }
+  int id;
+  {
+    MutexLock lock(mutex_);
+    id = next_id_++;
+    subscribers_.push_back(std::make_unique<Subscriber>(id, config));
+  }
+  xSemaphoreGive(wake_);
+  return id;
+}
+
+bool CameraBroadcaster::Unsubscribe(int id) {
+  bool found = false;
+  {
+    MutexLock lock(mutex_);
+    auto it = std::find_if(
+        subscribers_.begin(), subscribers_.end(),
+        [id](const std::unique_ptr<Subscriber>& s) { return s->id == id; });
+    if (it != subscribers_.end()) {
+      subscribers_.erase(it);
+      found = true;
+    }
+  }
+  xSemaphoreGive(wake_);
+  return found;
+}
+
+bool CameraBroadcaster::WaitForFrame(int id, TickType_t timeout,
+                                     CameraFrameInfo* info) {
+  Subscriber* subscriber;
+  {
+    MutexLock lock(mutex_);
+    subscriber = Find(id);
+  }
+  if (!subscriber) {
+    return false;
+  }
+  xSemaphoreGive(subscriber->ready);
+  xSemaphoreGive(wake_);
+  if (xSemaphoreTake(subscriber->filled, timeout) != pdTRUE) {
+    // Take the buffer back. If the broadcaster already claimed it, a frame is
+    // being written into it; wait for that frame rather than let it be
+    // written while the subscriber reads.
+    if (xSemaphoreTake(subscriber->ready, 0) == pdTRUE) {
+      return false;
+    }
+    CHECK(xSemaphoreTake(subscriber->filled, portMAX_DELAY) == pdTRUE);
+  }
+  if (!subscriber->converted) {
+    return false;
+  }
+  if (info) {
+    *info = subscriber->info;
+  }
+  return true;
+}
+
+CameraBroadcaster::Subscriber* CameraBroadcaster::Find(int id) {
+  for (auto& subscriber : subscribers_) {
+    if (subscriber->id == id) return subscriber.get();
+  }
+  return nullptr;
+}
+
+void CameraBroadcaster::StaticRun(void* param) {
+  static_cast<CameraBroadcaster*>(param)->Run();
+  vTaskSuspend(nullptr);
+}
+
+void CameraBroadcaster::Run() {
+  CameraFrameLease lease;
+  while (!stop_) {
+    bool idle;
+    {
+      MutexLock lock(mutex_);
+      idle = subscribers_.empty();
+    }
+    if (idle) {
+      xSemaphoreTake(wake_, portMAX_DELAY);
+      continue;
+    }
+
+    // Frames are taken as they arrive, even when no subscriber is ready, so
+    // that subscribers always get the newest frame rather than a queued one.
+    if (!CameraTask::GetSingleton()->LeaseFrame(&lease)) {
+      // The camera is off; try again when a subscriber next asks for a frame.
+      xSemaphoreTake(wake_, portMAX_DELAY);
+      continue;
+    }
+    while (Deliver(lease) && !stop_) {
+      xSemaphoreTake(wake_, portMAX_DELAY);
+    }
+    lease.Release();
+  }
+}
+
+bool CameraBroadcaster::Deliver(const CameraFrameLease& lease) {
+  bool waiting = false;
+  {
+    MutexLock lock(mutex_);
+    due_.clear();
+    due_.reserve(subscribers_.size());
+    for (auto& subscriber : subscribers_) {
+      if (subscriber->info.sequence == lease.sequence() ||
+          !subscriber->Due(lease.timestamp_us())) {
+        continue;
+      }
+      if (xSemaphoreTake(subscriber->ready, 0) == pdTRUE) {
+        due_.push_back(subscriber.get());
+      } else if (subscriber->config.drop_policy == CameraDropPolicy::kWait) {
+        waiting = true;
+      }
+    }
+  }
+  if (due_.empty()) {
+    return waiting;
+  }
+
+  // The lock isn't held from here on, so subscribers can come and go while
+  // the frame is processed. The due subscribers can't: each waits in
+  // `WaitForFrame()` until its buffer is filled, and mustn't unsubscribe
+  // meanwhile.
+
+  // Each distinct image is processed once, into the buffer of the first
+  // subscriber that asked for it, and copied to the others.
+  convert_fmts_.clear();
+  convert_fmts_.reserve(due_.size());
+  for (auto it = due_.begin(); it != due_.end(); ++it) {
+    Subscriber* subscriber = *it;
+    auto source = std::find_if(due_.begin(), it, [subscriber](Subscriber* s) {
+      return !s->source && SameImage(s->config.fmt, subscriber->config.fmt);
+    });
+    subscriber->source = source != it ? *source : nullptr;
+    if (!subscriber->source) {
+      convert_fmts_.push_back(subscriber->config.fmt);
+    }
+  }
+  const bool ok =
+      CameraTask::GetSingleton()->ConvertFrame(lease, convert_fmts_);
+
+  // Copy everything before handing any buffer back, as the buffers copied
+  // from are subscribers' too.
+  for (Subscriber* subscriber : due_) {
+    if (ok && subscriber->source) {
+      std::memcpy(subscriber->config.fmt.buffer,
+                  subscriber->source->config.fmt.buffer,
+                  ImageSize(subscriber->config.fmt));
+    }
+  }
+  for (Subscriber* subscriber : due_) {
+    subscriber->Delivered(lease, ok);
+    xSemaphoreGive(subscriber->filled);
+  }
+  return waiting;
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_CAMERA_CAMERA_BROADCASTER_H_
+#define LIBS_CAMERA_CAMERA_BROADCASTER_H_
+
+#include <memory>
+#include <vector>
+
+#include "libs/camera/camera.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+namespace coralmicro {
+
+// What to do with a frame due for a subscriber that is still busy with its
+// previous frame.
+enum class CameraDropPolicy {
+  // Skip the frame; the subscriber gets the first frame after it is ready.
+  kSkip,
+  // Hold the frame until the subscriber is ready. This holds back every
+  // other subscriber too, so use it only for consumers that must not miss
+  // frames.
+  kWait,
+};
+
+// Specifies the frames that a `CameraBroadcaster` subscriber receives.
+struct CameraSubscriberConfig {
+  // Image format and the buffer the frames are delivered into.
+  CameraFrameFormat fmt;
+  // Maximum number of frames per second to deliver, or 0 for every frame.
+  int max_fps = 0;
+  // Handling of frames that arrive while the subscriber is busy.
+  CameraDropPolicy drop_policy = CameraDropPolicy::kSkip;
+};
+
+// Describes a frame delivered by `CameraBroadcaster::WaitForFrame()`.
+struct CameraFrameInfo {
+  // The frame's `CameraFrameLease::sequence()`.
+  uint32_t sequence;
+  // The frame's `CameraFrameLease::timestamp_us()`.
+  uint64_t timestamp_us;
+};
+
+// Shares the camera stream between several consumers.
+//
+// Each subscriber asks for its own image format and frame rate. The
+// broadcaster captures each frame once, processes it once for each distinct
+// format, and copies the result to every subscriber that asked for that
+// format. So a detector, a preview stream and motion analysis running
+// together capture and demosaic each frame just once, instead of each calling
+// `CameraTask::GetFrame()`.
+//
+// A subscriber owns its buffer (`CameraSubscriberConfig::fmt.buffer`) except
+// while it waits in `WaitForFrame()`, which is when the broadcaster writes the
+// next frame into it. The camera must be powered and enabled in streaming
+// mode. For example:
+//
+// ```
+// CameraBroadcaster broadcaster(kCameraTaskPriority - 1);
+// CameraSubscriberConfig config;
+// config.fmt = {CameraFormat::kRgb, CameraFilterMethod::kBilinear,
+//               CameraRotation::k270, 320, 320, true, image.data()};
+// config.max_fps = 10;
+// int id = broadcaster.Subscribe(config);
+// while (broadcaster.WaitForFrame(id, portMAX_DELAY)) {
+//   // Use `image`.
+// }
+// ```
+class CameraBroadcaster {
+ public:
+  // Constructor.
+  //
+  // @param task_priority Priority for the internal FreeRTOS task that captures
+  // and delivers frames.
+  explicit CameraBroadcaster(int task_priority);
+  //@cond
+  CameraBroadcaster(const CameraBroadcaster&) = delete;
+  CameraBroadcaster& operator=(const CameraBroadcaster&) = delete;
+  ~CameraBroadcaster();
+  //@endcond
+
+  // Adds a subscriber. Frames are not delivered until it calls
+  // `WaitForFrame()`.
+  //
+  // @param config The subscriber's format, buffer, rate and drop policy.
+  // @return A unique id for the subscriber.
+  int Subscribe(const CameraSubscriberConfig& config);
+
+  // Removes a subscriber. Call this from the subscriber's own task, not while
+  // it waits in `WaitForFrame()`.
+  //
+  // @param id The id of the subscriber to remove.
+  // @return True if successfully removed, false otherwise.
+  bool Unsubscribe(int id);
+
+  // Waits for the subscriber's next frame to be delivered into its buffer.
+  // The buffer is then the subscriber's until it calls this again.
+  //
+  // On timeout the buffer is the subscriber's again, holding its previous
+  // contents, and no frame is delivered into it until the next call. If a
+  // frame was already being delivered when the timeout expired, this waits
+  // for it to finish and returns true instead.
+  //
+  // If the frame couldn't be processed, this returns false with the buffer's
+  // contents unspecified, and the next call waits for a later frame.
+  //
+  // @param id The id of the subscriber.
+  // @param timeout Maximum time to wait, in ticks.
+  // @param info Set to the frame's sequence number and timestamp, if not null.
+  // @return True if a new frame is in the buffer, false on timeout, if the
+  // frame couldn't be processed, or if the id is unknown.
+  bool WaitForFrame(int id, TickType_t timeout,
+                    CameraFrameInfo* info = nullptr);
+
+ private:
+  struct Subscriber;
+
+  static void StaticRun(void* param);
+  void Run();
+  Subscriber* Find(int id);
+  // Delivers `lease` to the due subscribers that are ready for it, and
+  // returns whether any subscriber with `CameraDropPolicy::kWait` is still
+  // waiting for it.
+  bool Deliver(const CameraFrameLease& lease);
+
+  TaskHandle_t task_;
+  // Guards `subscribers_` and `next_id_`.
+  SemaphoreHandle_t mutex_;
+  // Given when there is new work for the task: a subscriber was added or
+  // removed or became ready, or the broadcaster is stopping.
+  SemaphoreHandle_t wake_;
+  std::vector<std::unique_ptr<Subscriber>> subscribers_;
+  int next_id_{0};
+  volatile bool stop_{false};
+  // Reused for every frame, to avoid allocating. Only the task uses these.
+  std::vector<CameraFrameFormat> convert_fmts_;
+  std::vector<Subscriber*> due_;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_CAMERA_CAMERA_BROADCASTER_H_
@@ -66,6 +66,23 @@ std::vector<uint8_t>* GetResource(const std::string& resource_name) {
   return &it->second;
 }
 
+// Appends `str` to `s` as a quoted JSON string.
+void StrAppendJsonString(std::string* s, const char* str) {
+  *s += '"';
+  for (; str && *str; ++str) {
+    const auto c = static_cast<unsigned char>(*str);
+    if (c == '"' || c == '\\') {
+      *s += '\\';
+      *s += static_cast<char>(c);
+    } else if (c < 0x20) {
+      StrAppend(s, "\\u%04x", static_cast<unsigned>(c));
+    } else {
+      *s += static_cast<char>(c);
+    }
+  }
+  *s += '"';
+}
+
 std::optional<TempSensor> CheckTempSensor(int sensor_num) {
   if (sensor_num == 0) return TempSensor::kCpu;
   if (sensor_num == 1) return TempSensor::kTpu;
@@ -642,6 +659,56 @@ void GetTemperature(struct jsonrpc_request* request) {
   jsonrpc_return_success(request, "{%Q:%g}", "temperature", temperature);
 }
 
+// Implements the "set_tpu_profiling" RPC.
+// Enables or disables per-phase Edge TPU invoke profiling, optionally
+// clearing the profiles recorded so far.
+void SetTpuProfiling(struct jsonrpc_request* request) {
+  bool enable;
+  if (!JsonRpcGetBooleanParam(request, "enable", &enable)) return;
+
+  auto* manager = coralmicro::EdgeTpuManager::GetSingleton();
+  int reset;
+  if (mjson_get_bool(request->params, request->params_len, "$.reset",
+                     &reset) &&
+      reset) {
+    manager->ResetProfiles();
+  }
+  manager->SetProfilingEnabled(enable);
+  jsonrpc_return_success(request, "{}");
+}
+
+// Implements the "get_tpu_profile" RPC.
+// Returns min/avg/p99 time and bytes moved for each phase of the recent
+// invokes of every profiled model.
+void GetTpuProfile(struct jsonrpc_request* request) {
+  std::string s;
+  for (const auto& profile :
+       coralmicro::EdgeTpuManager::GetSingleton()->GetProfiles()) {
+    s += R"({"name":)";
+    StrAppendJsonString(&s, profile.name);
+    coralmicro::StrAppend(&s, R"(,"invokes":%lu,"phases":{)",
+                          static_cast<unsigned long>(profile.invokes));
+    for (int i = 0; i < coralmicro::kEdgeTpuPhaseCount; ++i) {
+      const auto& phase = profile.phases[i];
+      coralmicro::StrAppend(
+          &s,
+          R"("%s":{"min_us":%lu,"avg_us":%lu,"p99_us":%lu,"bytes":%.0f},)",
+          coralmicro::EdgeTpuPhaseName(
+              static_cast<coralmicro::EdgeTpuPhase>(i)),
+          static_cast<unsigned long>(phase.min_us),
+          static_cast<unsigned long>(phase.avg_us),
+          static_cast<unsigned long>(phase.p99_us),
+          // newlib-nano's printf has no %llu.
+          static_cast<double>(phase.bytes));
+    }
+    s.pop_back();
+    s += "}},";
+  }
+  if (!s.empty()) s.pop_back();
+
+  jsonrpc_return_success(request, "{%Q:[%s]}", "profiles", s.c_str());
+}
+
 // Implements the "capture_test_pattern" RPC.
 // Configures the sensor to test pattern mode, and captures via trigger.
 // Returns success if the test pattern has the expected data, failure otherwise.
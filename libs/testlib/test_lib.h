@@ -39,6 +39,8 @@ inline constexpr char kMethodRunSegmentationModel[] = "run_segmentation_model";
 inline constexpr char kMethodStartM4[] = "start_m4";
 inline constexpr char kMethodCaptureTestPattern[] = "capture_test_pattern";
 inline constexpr char kMethodGetTemperature[] = "get_temperature";
+inline constexpr char kMethodSetTpuProfiling[] = "set_tpu_profiling";
+inline constexpr char kMethodGetTpuProfile[] = "get_tpu_profile";
 inline constexpr char kMethodCaptureAudio[] = "capture_audio";
 inline constexpr char kMethodWiFiSetAntenna[] = "wifi_set_antenna";
 inline constexpr char kMethodWiFiScan[] = "wifi_scan";
@@ -69,6 +71,8 @@ void RunSegmentationModel(struct jsonrpc_request* request);
 void RunDetectionModel(struct jsonrpc_request* request);
 void StartM4(struct jsonrpc_request* request);
 void GetTemperature(struct jsonrpc_request* request);
+void SetTpuProfiling(struct jsonrpc_request* request);
+void GetTpuProfile(struct jsonrpc_request* request);
 void CaptureTestPattern(struct jsonrpc_request* request);
 void CaptureAudio(struct jsonrpc_request* request);
 void WiFiSetAntenna(struct jsonrpc_request* request);
@@ -16,9 +16,12 @@
 
 #include "libs/tpu/edgetpu_dfu_task.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 
+#include "libs/base/timer.h"
 #include "libs/tpu/edgetpu_manager.h"
 #include "libs/usb/usb_host_task.h"
 #include "third_party/nxp/rt1176-sdk/middleware/usb/host/class/usb_host_dfu.h"
@@ -31,6 +34,12 @@ namespace coralmicro {
 
 using namespace edgetpu_dfu;
 
+namespace {
+constexpr uint8_t kDfuFunctionalDescriptorType = 0x21;
+// Offset of wTransferSize in the DFU functional descriptor.
+constexpr int kTransferSizeOffset = 5;
+}  // namespace
+
 void EdgeTpuDfuTask::SetNextState(DfuState next_state) {
   Request req;
   req.type = RequestType::kNextState;
@@ -58,6 +67,7 @@ usb_status_t EdgeTpuDfuTask::USB_DFUHostEvent(
         if (id == USB_HOST_DFU_SUBCLASS_CODE) {
           SetDeviceHandle(device_handle);
           SetInterfaceHandle(interface_ptr);
+          SetTransferSize(interface_ptr);
           break;
         }
       }
@@ -142,7 +152,9 @@ void EdgeTpuDfuTask::ZeroLengthTransferCallback(void *param, uint8_t *data,
 
   task->SetCurrentBlockNumber(0);
   task->SetBytesTransferred(0);
-  task->SetNextState(DfuState::kReadBack);
+  task->stats_.download_us = task->EndPhase(&task->phase_start_us_);
+  task->SetNextState(task->NeedsReadBack() ? DfuState::kReadBack
+                                           : DfuState::kDetach);
 }
 
 void EdgeTpuDfuTask::ReadBackCallback(void *param, uint8_t *data,
@@ -154,7 +166,24 @@ void EdgeTpuDfuTask::ReadBackCallback(void *param, uint8_t *data,
     task->SetNextState(DfuState::kError);
     return;
   }
+  if (data_length == 0) {
+    printf("Read back firmware is truncated!\r\n");
+    task->SetNextState(DfuState::kError);
+    return;
+  }
 
+  // Each block is compared with the image as it arrives, so only one block
+  // is ever held.
+  const size_t offset = task->bytes_transferred();
+  if (offset + data_length > apex_latest_single_ep_bin_len ||
+      std::memcmp(task->read_back_data(), apex_latest_single_ep_bin + offset,
+                  data_length) != 0) {
+    printf("Read back firmware does not match!\r\n");
+    free(task->read_back_data());
+    task->SetReadBackData(nullptr);
+    task->SetNextState(DfuState::kError);
+    return;
+  }
   task->SetCurrentBlockNumber(task->current_block_number() + 1);
   task->SetBytesTransferred(task->bytes_transferred() + data_length);
 #if 0
@@ -178,13 +207,10 @@ void EdgeTpuDfuTask::GetStatusReadCallback(void *param, uint8_t *data,
   if (task->bytes_transferred() < task->bytes_to_transfer()) {
     task->SetNextState(DfuState::kReadBack);
   } else {
-    if (memcmp(apex_latest_single_ep_bin, task->read_back_data(),
-               apex_latest_single_ep_bin_len) != 0) {
-      printf("Read back firmware does not match!\r\n");
-      task->SetNextState(DfuState::kError);
-    } else {
-      task->SetNextState(DfuState::kDetach);
-    }
+    task->stats_.read_back_us = task->EndPhase(&task->phase_start_us_);
+    task->stats_.verified = true;
+    task->verified_once_ = true;
+    task->SetNextState(DfuState::kDetach);
     free(task->read_back_data());
     task->SetReadBackData(nullptr);
     task->SetCurrentBlockNumber(0);
@@ -216,6 +242,43 @@ void EdgeTpuDfuTask::CheckStatusCallback(void *param, uint8_t *data,
   task->SetNextState(DfuState::kComplete);
 }
 
+void EdgeTpuDfuTask::SetTransferSize(const usb_host_interface_t *interface) {
+  transfer_size_ = kDefaultTransferSize;
+  const uint8_t *desc = interface->interfaceExtension;
+  const uint8_t *end = desc + interface->interfaceExtensionLength;
+  while (desc + 1 < end && desc[0] != 0) {
+    if (desc[1] == kDfuFunctionalDescriptorType &&
+        desc[0] > kTransferSizeOffset + 1 && desc + desc[0] <= end) {
+      const uint32_t size = desc[kTransferSizeOffset] |
+                            (desc[kTransferSizeOffset + 1] << 8);
+      if (size != 0) {
+        transfer_size_ = size;
+      }
+      return;
+    }
+    desc += desc[0];
+  }
+}
+
+bool EdgeTpuDfuTask::NeedsReadBack() const {
+  switch (verification_) {
+    case EdgeTpuDfuVerification::kAlways:
+      return true;
+    case EdgeTpuDfuVerification::kFirstBoot:
+      return !verified_once_;
+    case EdgeTpuDfuVerification::kNever:
+      return false;
+  }
+  return true;
+}
+
+uint32_t EdgeTpuDfuTask::EndPhase(uint64_t *start_us) {
+  const uint64_t now = TimerMicros();
+  const auto elapsed = static_cast<uint32_t>(now - *start_us);
+  *start_us = now;
+  return elapsed;
+}
+
 void EdgeTpuDfuTask::TaskInit() {
   coralmicro::UsbHostTask::GetSingleton()->RegisterUsbHostEventCallback(
       kDfuVid, kDfuPid,
@@ -230,6 +293,9 @@ void EdgeTpuDfuTask::HandleNextState(NextStateRequest &req) {
     case DfuState::kUnattached:
       break;
     case DfuState::kAttached:
+      start_us_ = phase_start_us_ = TimerMicros();
+      stats_ = {};
+      stats_.block_size = transfer_size_;
       ret = USB_HostDfuInit(device_handle(), &class_handle_);
       if (ret == kStatus_USB_Success) {
         SetNextState(DfuState::kSetInterface);
@@ -254,8 +320,8 @@ void EdgeTpuDfuTask::HandleNextState(NextStateRequest &req) {
       break;
     case DfuState::kTransfer:
       transfer_length =
-          std::min(256U /* get from descriptor */,
-                   apex_latest_single_ep_bin_len - bytes_transferred());
+          std::min<size_t>(transfer_size_,
+                           apex_latest_single_ep_bin_len - bytes_transferred());
       ret = USB_HostDfuDnload(class_handle(), current_block_number(),
                               apex_latest_single_ep_bin + bytes_transferred(),
                               transfer_length, EdgeTpuDfuTask::TransferCallback,
@@ -273,17 +339,21 @@ void EdgeTpuDfuTask::HandleNextState(NextStateRequest &req) {
       }
       break;
     case DfuState::kReadBack:
+      // Blocks are checked as they arrive, so only one is buffered.
       if (!read_back_data()) {
-        SetReadBackData(
-            static_cast<uint8_t *>(malloc(apex_latest_single_ep_bin_len)));
+        SetReadBackData(static_cast<uint8_t *>(malloc(transfer_size_)));
+        if (!read_back_data()) {
+          printf("Failed to allocate DFU read back buffer\r\n");
+          SetNextState(DfuState::kError);
+          break;
+        }
       }
       transfer_length =
-          std::min(256U /* get from descriptor */,
-                   apex_latest_single_ep_bin_len - bytes_transferred());
+          std::min<size_t>(transfer_size_,
+                           apex_latest_single_ep_bin_len - bytes_transferred());
       ret = USB_HostDfuUpload(class_handle(), current_block_number(),
-                              read_back_data() + bytes_transferred(),
-                              transfer_length, EdgeTpuDfuTask::ReadBackCallback,
-                              this);
+                              read_back_data(), transfer_length,
+                              EdgeTpuDfuTask::ReadBackCallback, this);
       if (ret != kStatus_USB_Success) {
         SetNextState(DfuState::kError);
       }
@@ -297,6 +367,7 @@ void EdgeTpuDfuTask::HandleNextState(NextStateRequest &req) {
       }
       break;
     case DfuState::kDetach:
+      stats_.total_us = static_cast<uint32_t>(TimerMicros() - start_us_);
       ret = USB_HostDfuDetach(class_handle(), 1000 /* ms */,
                               EdgeTpuDfuTask::DetachCallback, this);
       if (ret != kStatus_USB_Success) {
@@ -35,6 +35,34 @@ namespace coralmicro {
 inline constexpr int kDfuVid = 0x1A6E;
 inline constexpr int kDfuPid = 0x089A;
 
+// How the Edge TPU firmware is checked after it's downloaded.
+enum class EdgeTpuDfuVerification : uint8_t {
+  // Reads the firmware back after every download and compares it with the
+  // image, a block at a time. This is the default. The device can't check
+  // the firmware itself, so this reads back the whole image and takes as
+  // long as the download.
+  kAlways,
+  // Reads the firmware back only until it has been verified once since the
+  // board booted. Later power-ups download the same image over the same
+  // link, so they skip the read back, which takes as long as the download.
+  kFirstBoot,
+  // Never reads the firmware back.
+  kNever,
+};
+
+// Timings of the last Edge TPU firmware download.
+struct EdgeTpuDfuStats {
+  // From enumeration of the DFU device until it's told to detach.
+  uint32_t total_us;
+  uint32_t download_us;
+  // 0 if the firmware wasn't read back.
+  uint32_t read_back_us;
+  // Bytes per DFU block, as advertised by the device.
+  uint32_t block_size;
+  // Whether the firmware was read back and matched.
+  bool verified;
+};
+
 namespace edgetpu_dfu {
 
 enum class DfuState : uint8_t {
@@ -81,6 +109,9 @@ class EdgeTpuDfuTask
                        kEdgeTpuDfuTaskName, configMINIMAL_STACK_SIZE * 3,
                        kEdgeTpuDfuTaskPriority, /*QueueLength=*/4> {
  public:
+  // Block size used if the device doesn't advertise one.
+  static constexpr uint32_t kDefaultTransferSize = 256;
+
   static EdgeTpuDfuTask *GetSingleton() {
     static EdgeTpuDfuTask task;
     return &task;
@@ -147,11 +178,28 @@ class EdgeTpuDfuTask
   }
   uint8_t *read_back_data() { return read_back_data_; }
 
+  // Sets how firmware downloads are verified. Takes effect at the next
+  // Edge TPU power-up.
+  void SetVerification(EdgeTpuDfuVerification verification) {
+    verification_ = verification;
+  }
+  EdgeTpuDfuVerification verification() const { return verification_; }
+
+  // Gets the timings of the last firmware download.
+  EdgeTpuDfuStats stats() const { return stats_; }
+
  private:
   void TaskInit() override;
   void RequestHandler(edgetpu_dfu::Request *req) override;
   void HandleNextState(edgetpu_dfu::NextStateRequest &req);
   void SetNextState(edgetpu_dfu::DfuState next_state);
+  // Reads `wTransferSize` from the DFU functional descriptor of `interface`.
+  void SetTransferSize(const usb_host_interface_t *interface);
+  // Whether the firmware just downloaded has to be read back.
+  bool NeedsReadBack() const;
+  // Ends a phase of the download that started at `*start_us`, returning its
+  // duration and starting the next phase.
+  uint32_t EndPhase(uint64_t *start_us);
 
   usb_host_instance_t *host_instance_;
   usb_device_handle device_handle_;
@@ -161,7 +209,15 @@ class EdgeTpuDfuTask
   size_t bytes_transferred_ = 0;
   size_t bytes_to_transfer_ = apex_latest_single_ep_bin_len;
   size_t current_block_number_ = 0;
+  // One block of read back firmware.
   uint8_t *read_back_data_ = nullptr;
+  uint32_t transfer_size_ = kDefaultTransferSize;
+  EdgeTpuDfuVerification verification_ = EdgeTpuDfuVerification::kAlways;
+  // Whether a download has been verified since boot.
+  bool verified_once_ = false;
+  uint64_t start_us_ = 0;
+  uint64_t phase_start_us_ = 0;
+  EdgeTpuDfuStats stats_ = {};
 };
 
 }  // namespace coralmicro
@@ -16,40 +16,86 @@
 
 #include "libs/tpu/edgetpu_driver.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "libs/base/check.h"
+#include "libs/base/timer.h"
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/config/beagle_csr_helper.h"
 #include "libs/tpu/darwinn/driver/config/common_csr_helper.h"
 #include "third_party/freertos_kernel/include/FreeRTOS.h"
 #include "third_party/freertos_kernel/include/semphr.h"
-#include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
-#include "third_party/nxp/rt1176-sdk/middleware/usb/include/usb_spec.h"
+#include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_clock.h"
+#include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_common.h"
 
 namespace coralmicro {
 namespace {
-constexpr uint8_t kSingleBulkOutEndpoint = 1;
-constexpr uint8_t kEventInEndpoint = 2;
-constexpr uint8_t kInterruptInEndpoint = 3;
 constexpr uint32_t kMaxBulkBufferSize = 32 * 1024;
-uint8_t BulkTransferBuffer[kMaxBulkBufferSize];
-
-struct UsbTransferMetadata {
-  SemaphoreHandle_t sema;
-  usb_status_t status;
-  size_t bytes_transferred;
-};
+constexpr size_t kEventSizeBytes = 16;
+constexpr TickType_t kTransferTimeout = pdMS_TO_TICKS(200);
+__attribute__((aligned(64))) uint8_t
+    BulkTransferBuffer[TpuDriver::kMaxInFlightTransfers][kMaxBulkBufferSize];
+__attribute__((aligned(64))) uint8_t EventBuffer[kEventSizeBytes];
+// One cache line per register access in flight.
+constexpr size_t kCsrBufferSize = 32;
+__attribute__((aligned(64))) uint8_t
+    CsrBuffer[TpuDriver::kMaxCsrInFlight][kCsrBufferSize];
+// Chip state changes during bring-up take microseconds; a register that
+// hasn't settled by this point never will.
+constexpr uint64_t kCsrPollTimeoutUs = 100000;
+
+// Direct bulk-in transfers are cut on packet boundaries so a packet never
+// straddles caller memory and a bounce buffer.
+constexpr uint32_t kBulkInPacketSize = 512;
+constexpr uint32_t kBulkOutAlignment = 4;
 }  // namespace
 
+void CopyWithXorMask(uint8_t *dst, const uint8_t *src, uint32_t length,
+                     uint32_t xor_mask) {
+  if (xor_mask == 0) {
+    memcpy(dst, src, length);
+    return;
+  }
+  uint32_t i = 0;
+  for (; i + 4 <= length; i += 4) {
+    uint32_t word;
+    memcpy(&word, src + i, sizeof(word));
+    word ^= xor_mask;
+    memcpy(dst + i, &word, sizeof(word));
+  }
+  for (; i < length; ++i) {
+    dst[i] = src[i] ^ static_cast<uint8_t>(xor_mask >> (8 * (i % 4)));
+  }
+}
+
 namespace registers = platforms::darwinn::driver::config::registers;
 
-bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
+bool TpuDriver::Initialize(EdgeTpuTransport *transport,
                            PerformanceMode mode) {
-  if (usb_instance == nullptr) {
+  if (transport == nullptr || !transport->Connected()) {
+    return false;
+  }
+  transport_ = transport;
+  if (!InitializeTransfers()) {
+    return false;
+  }
+  return Configure(mode);
+}
+
+bool TpuDriver::SetPerformanceMode(PerformanceMode mode) {
+  if (mode == mode_) {
+    return true;
+  }
+  if (!FlushSends()) {
     return false;
   }
-  usb_instance_ = usb_instance;
+  return Configure(mode);
+}
+
+bool TpuDriver::Configure(PerformanceMode mode) {
+  const uint64_t start_us = TimerMicros();
 
   // Check chip id and test write
   uint32_t omc0_00_reg;
@@ -73,7 +119,6 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   scu_ctrl_0.set_rg_pcie_inact_phy_mode(0);
   scu_ctrl_0.set_rg_usb_inact_phy_mode(0);
   CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, scu_ctrl_0.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, &scu_ctrl_0_reg));
 
   // Disable clock gating
   uint32_t scu_ctrl_2_reg;
@@ -81,7 +126,6 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   registers::ScuCtrl2 scu_ctrl_2(scu_ctrl_2_reg);
   scu_ctrl_2.set_rg_gated_gcb(0x2);
   CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
 
   // Go into reset, if we're not there
   uint32_t scu_ctrl_3_reg;
@@ -91,18 +135,17 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
     scu_ctrl_3.set_rg_force_sleep(0x3);
     CHECK(
         Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
-    do {
-      CHECK(
-          Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-      scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-    } while (scu_ctrl_3.cur_pwr_state() != 0x2);
+    CHECK(Poll(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg,
+               [](uint32_t reg) {
+                 return registers::ScuCtrl3(reg).cur_pwr_state() == 0x2;
+               }));
+    scu_ctrl_3.set_raw(scu_ctrl_3_reg);
     CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0xF));
     CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0x0));
   }
 
-  // Set performance mode and exit reset.
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-  scu_ctrl_3.set_raw(scu_ctrl_3_reg);
+  // Set performance mode and exit reset. `scu_ctrl_3` holds the register's
+  // last read value.
   scu_ctrl_3.set_rg_force_sleep(0x2);
   switch (mode) {
     case PerformanceMode::kMax:
@@ -132,17 +175,15 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   }
   CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
 
-  do {
-    CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-    scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-  } while (scu_ctrl_3.cur_pwr_state() != 0x0);
+  CHECK(Poll(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg,
+             [](uint32_t reg) {
+               return registers::ScuCtrl3(reg).cur_pwr_state() == 0x0;
+             }));
 
   // Check a known register to verify reset exit.
   uint64_t scalar_core_run_control;
-  do {
-    CHECK(Read64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
-                 &scalar_core_run_control));
-  } while (scalar_core_run_control != 0);
+  CHECK(Poll(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
+             &scalar_core_run_control, [](uint64_t reg) { return reg == 0; }));
 
   registers::IdleRegister idle_reg;
   idle_reg.set_enable();
@@ -155,10 +196,9 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
                 tile_config.raw()));
 
   uint64_t tile_config_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tile_config_reg));
-  } while (tile_config.raw() != tile_config_reg);
+  CHECK(Poll(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+             &tile_config_reg,
+             [&](uint64_t reg) { return reg == tile_config.raw(); }));
 
   registers::DeepSleep deep_sleep_reg;
   deep_sleep_reg.set_to_sleep_delay(2);
@@ -166,9 +206,8 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   CHECK(Write64(chip_config_.GetTileCsrOffsets().deepSleep,
                 deep_sleep_reg.raw()));
 
-  // Enable clock gating
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
-  scu_ctrl_2.set_raw(scu_ctrl_2_reg);
+  // Enable clock gating. Nothing else writes `scu_ctrl_2`, so it still holds
+  // the value written above.
   scu_ctrl_2.set_rg_gated_gcb(1);
   CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
 
@@ -197,6 +236,7 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
   CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_d8, omc0_d8.raw()));
 
   // Wait 100 us before enabling tempsense flow.
+  CHECK(FlushCsr());
   SDK_DelayAtLeastUs(100, CLOCK_GetFreq(kCLOCK_CpuClk));
 
   // Enables tempsense flow.
@@ -207,272 +247,371 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
 
   CHECK(DoRunControl(platforms::darwinn::driver::RunControl::kMoveToRun));
 
+  mode_ = mode;
+  bring_up_us_ = static_cast<uint32_t>(TimerMicros() - start_us);
   return true;
 }
 
-bool TpuDriver::CSRTransfer(uint64_t reg, void *data, bool read,
-                            RegisterSize reg_size) {
-  bool ret = false;
-  usb_status_t control_status;
-  usb_setup_struct_t setup_packet;
-  setup_packet.bmRequestType =
-      USB_REQUEST_TYPE_TYPE_VENDOR | USB_REQUEST_TYPE_RECIPIENT_DEVICE;
-  setup_packet.bmRequestType |=
-      read ? USB_REQUEST_TYPE_DIR_IN : USB_REQUEST_TYPE_DIR_OUT;
+bool TpuDriver::SubmitCsr(uint64_t reg, const void *data, bool read,
+                          RegisterSize reg_size, BulkTransfer **csr) {
+  // Slots are used round-robin, so waiting on this one also retires every
+  // access queued before it.
+  BulkTransfer *transfer = &csr_[next_csr_];
+  if (!WaitForTransfer(transfer)) {
+    return false;
+  }
+  next_csr_ = (next_csr_ + 1) % kMaxCsrInFlight;
+
+  EdgeTpuControlRequest request;
+  request.read = read;
   switch (reg_size) {
     case RegisterSize::kRegSize32:
-      setup_packet.bRequest = 1;
-      setup_packet.wLength = 4;
+      request.request = 1;
+      transfer->length = 4;
       break;
     case RegisterSize::kRegSize64:
-      setup_packet.bRequest = 0;
-      setup_packet.wLength = 8;
+      request.request = 0;
+      transfer->length = 8;
       break;
   }
+  request.value = 0xFFFF & reg;
+  request.index = 0xFFFF & (reg >> 16);
+  transfer->data = transfer->buffer;
+  if (!read) {
+    memcpy(transfer->buffer, data, transfer->length);
+  }
+  transfer->ok = false;
+  transfer->transferred = 0;
+  if (!transport_->Control(request, transfer)) {
+    return false;
+  }
+  transfer->pending = true;
+  if (csr) *csr = transfer;
+  return true;
+}
 
-  setup_packet.wValue = 0xFFFF & reg;
-  setup_packet.wIndex = 0xFFFF & (reg >> 16);
+bool TpuDriver::FlushCsr() {
+  bool ret = true;
+  for (auto &transfer : csr_) {
+    if (!WaitForTransfer(&transfer)) {
+      ret = false;
+    }
+  }
+  return ret;
+}
 
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
+template <typename T, typename Done>
+bool TpuDriver::Poll(uint64_t reg, T *val, Done done) {
+  const uint64_t deadline_us = TimerMicros() + kCsrPollTimeoutUs;
+  while (true) {
+    bool read_ok;
+    if constexpr (sizeof(T) == sizeof(uint32_t)) {
+      read_ok = Read32(reg, val);
+    } else {
+      read_ok = Read64(reg, val);
+    }
+    if (!read_ok) return false;
+    if (done(*val)) return true;
+    if (TimerMicros() > deadline_us) {
+      printf("Timed out polling Edge TPU register 0x%lx\r\n",
+             static_cast<unsigned long>(reg));
+      return false;
+    }
+  }
+}
 
-  control_status = USB_HostEdgeTpuControl(
-      usb_instance_, &setup_packet, (uint8_t *)data,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
-      },
-      sema);
-  if (control_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuControl failed\r\n");
-    goto exit;
+bool TpuDriver::InitializeTransfers() {
+  auto init = [](BulkTransfer *transfer, uint8_t *buffer) {
+    if (!transfer->sema) {
+      transfer->sema = xSemaphoreCreateBinary();
+      if (!transfer->sema) return false;
+    }
+    transfer->done = [](EdgeTpuTransfer *transfer) {
+      xSemaphoreGive(static_cast<BulkTransfer *>(transfer)->sema);
+    };
+    transfer->buffer = buffer;
+    transfer->pending = false;
+    return true;
+  };
+
+  for (int i = 0; i < kMaxCsrInFlight; ++i) {
+    if (!init(&csr_[i], CsrBuffer[i])) return false;
   }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    ret = false;
-    printf("%s didn't get semaphore\r\n", __func__);
-    goto exit;
+  next_csr_ = 0;
+  for (int i = 0; i < kMaxInFlightTransfers; ++i) {
+    if (!init(&transfers_[i], BulkTransferBuffer[i])) return false;
   }
-
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
-  return ret;
+  next_transfer_ = 0;
+  return init(&event_, EventBuffer);
 }
 
 bool TpuDriver::SendData(DescriptorTag tag, const uint8_t *data,
-                         uint32_t length) const {
+                         uint32_t length, uint32_t xor_mask) {
   if (!WriteHeader(tag, length)) {
     printf("WriteHeader failed\r\n");
     return false;
   }
 
-  if (!BulkOutTransfer(data, length)) {
+  if (!BulkOutTransfer(data, length, /*stage=*/false, xor_mask)) {
     printf("BulkOutTransfer failed\r\n");
     return false;
   }
   return true;
 }
 
-bool TpuDriver::SendParameters(const uint8_t *data, uint32_t length) const {
+bool TpuDriver::SendParameters(const uint8_t *data, uint32_t length) {
   return SendData(DescriptorTag::kParameters, data, length);
 }
 
-bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length) const {
-  return SendData(DescriptorTag::kInputActivations, data, length);
+bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length,
+                           uint32_t xor_mask) {
+  return SendData(DescriptorTag::kInputActivations, data, length, xor_mask);
 }
 
-bool TpuDriver::SendInstructions(const uint8_t *data, uint32_t length) const {
+bool TpuDriver::SendInstructions(const uint8_t *data, uint32_t length) {
   return SendData(DescriptorTag::kInstructions, data, length);
 }
 
-bool TpuDriver::GetOutputs(uint8_t *data, uint32_t length) const {
+bool TpuDriver::GetOutputs(uint8_t *data, uint32_t length) {
   return BulkInTransfer(data, length);
 }
 
 bool TpuDriver::Read32(uint64_t reg, uint32_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize32);
+  BulkTransfer *csr;
+  if (!SubmitCsr(reg, nullptr, true, RegisterSize::kRegSize32, &csr) ||
+      !WaitForTransfer(csr)) {
+    return false;
+  }
+  memcpy(val, csr->buffer, sizeof(*val));
+  return true;
 }
 
 bool TpuDriver::Read64(uint64_t reg, uint64_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize64);
+  BulkTransfer *csr;
+  if (!SubmitCsr(reg, nullptr, true, RegisterSize::kRegSize64, &csr) ||
+      !WaitForTransfer(csr)) {
+    return false;
+  }
+  memcpy(val, csr->buffer, sizeof(*val));
+  return true;
 }
 
 bool TpuDriver::Write32(uint64_t reg, uint32_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize32);
+  return SubmitCsr(reg, &val, false, RegisterSize::kRegSize32, nullptr);
 }
 
 bool TpuDriver::Write64(uint64_t reg, uint64_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize64);
+  return SubmitCsr(reg, &val, false, RegisterSize::kRegSize64, nullptr);
 }
 
-ssize_t TpuDriver::BulkOutTransferInternal(uint8_t endpoint,
-                                           const uint8_t *data,
-                                           uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
-  meta.status = kStatus_USB_Error;
-
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkOutSend(
-      usb_instance_, endpoint, (uint8_t *)data, data_length,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
-        meta->bytes_transferred = data_length;
-        meta->status = status;
-        xSemaphoreGive(meta->sema);
-      },
-      &meta);
-
-  if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkOutSend failed\r\n");
-    goto exit;
-  }
-
-  if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
+bool TpuDriver::SubmitBulkOut(BulkTransfer *transfer, uint32_t length) {
+  transfer->length = length;
+  transfer->ok = false;
+  transfer->transferred = 0;
+  if (!transport_->BulkOut(transfer)) {
+    return false;
+  }
+  transfer->pending = true;
+  return true;
+}
+
+bool TpuDriver::SubmitBulkIn(BulkTransfer *transfer, uint32_t length) {
+  transfer->length = length;
+  transfer->ok = false;
+  transfer->transferred = 0;
+  if (!transport_->BulkIn(transfer)) {
+    return false;
+  }
+  transfer->pending = true;
+  return true;
+}
+
+bool TpuDriver::WaitForTransfer(BulkTransfer *transfer) {
+  if (!transfer->pending) {
+    return true;
+  }
+  if (xSemaphoreTake(transfer->sema, kTransferTimeout) == pdFALSE) {
     printf("%s didn't get semaphore\r\n", __func__);
-  };
+    return false;
+  }
+  transfer->pending = false;
+  if (!transfer->ok) {
+    printf("%s transfer failed\r\n", __func__);
+    return false;
+  }
+  return true;
+}
 
-exit:
-  vSemaphoreDelete(meta.sema);
+TpuDriver::BulkTransfer *TpuDriver::NextTransfer() {
+  BulkTransfer *transfer = &transfers_[next_transfer_];
+  next_transfer_ = (next_transfer_ + 1) % kMaxInFlightTransfers;
+  return transfer;
+}
 
-  if (meta.status == kStatus_USB_Success) {
-    return meta.bytes_transferred;
-  } else {
-    return -meta.status;
+bool TpuDriver::FlushSends() {
+  bool ret = true;
+  // Slots are used round-robin, so starting at `next_transfer_` visits them
+  // oldest first.
+  for (int i = 0; i < kMaxInFlightTransfers; ++i) {
+    if (!WaitForTransfer(&transfers_[(next_transfer_ + i) %
+                                     kMaxInFlightTransfers])) {
+      ret = false;
+    }
   }
+  return ret;
 }
 
-bool TpuDriver::BulkOutTransfer(const uint8_t *data,
-                                uint32_t data_length) const {
-  uint8_t *current_chunk = const_cast<uint8_t *>(data);
-  uint32_t bytes_left = data_length;
-
-  while (bytes_left > 0) {
-    uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
-    memcpy(BulkTransferBuffer, current_chunk, chunk_size);
-    ssize_t bytes_sent = BulkOutTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
-    if (bytes_sent > 0) {
-      current_chunk += bytes_sent;
-      bytes_left -= bytes_sent;
+bool TpuDriver::BulkOutTransfer(const uint8_t *data, uint32_t data_length,
+                                bool stage, uint32_t xor_mask) {
+  const bool direct =
+      !stage && xor_mask == 0 &&
+      transport_->CanTransferInPlace(data, data_length, kBulkOutAlignment);
+  while (data_length > 0) {
+    // Reusing a slot means its previous chunk has to be on the wire first;
+    // the chunk queued after it keeps the link busy in the meantime.
+    BulkTransfer *transfer = NextTransfer();
+    if (!WaitForTransfer(transfer)) {
+      printf("Bad BulkOutTransfer\r\n");
+      return false;
+    }
+    if (transfer->transferred != transfer->length) {
+      printf("Short BulkOutTransfer\r\n");
+      return false;
+    }
+    uint32_t chunk_size = std::min(kMaxBulkBufferSize, data_length);
+    if (direct) {
+      transfer->data = const_cast<uint8_t *>(data);
     } else {
-      printf("Bad BulkOutTransferInternal\r\n");
+      // Chunks are whole words, so the mask stays in phase across them.
+      CopyWithXorMask(transfer->buffer, data, chunk_size, xor_mask);
+      transfer->data = transfer->buffer;
+    }
+    if (!SubmitBulkOut(transfer, chunk_size)) {
       return false;
     }
+    data += chunk_size;
+    data_length -= chunk_size;
   }
 
   return true;
 }
 
-ssize_t TpuDriver::BulkInTransferInternal(uint8_t endpoint, uint8_t *data,
-                                          uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
-  meta.status = kStatus_USB_Error;
-
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, endpoint, data, data_length,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
-        meta->bytes_transferred = data_length;
-        meta->status = status;
-        xSemaphoreGive(meta->sema);
-      },
-      &meta);
-
-  if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkInRecv failed\r\n");
-    goto exit;
-  }
-
-  if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    printf("%s didn't get semaphore\r\n", __func__);
-  };
-
-exit:
-  vSemaphoreDelete(meta.sema);
-
-  if (meta.status == kStatus_USB_Success) {
-    return meta.bytes_transferred;
-  } else {
-    return -meta.status;
+bool TpuDriver::BulkInTransfer(uint8_t *data, uint32_t data_length) {
+  // The Edge TPU only starts producing outputs once it has everything that
+  // was sent, and the bounce buffers are shared with the send path.
+  if (!FlushSends()) {
+    return false;
   }
-}
 
-bool TpuDriver::BulkInTransfer(uint8_t *data, uint32_t data_length) const {
-  uint8_t *current_chunk = data;
-  uint32_t bytes_left = data_length;
-  while (bytes_left > 0) {
-    uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
-    ssize_t bytes_received = BulkInTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
-    if (bytes_received > 0) {
-      memcpy(current_chunk, BulkTransferBuffer, chunk_size);
-      current_chunk += bytes_received;
-      bytes_left -= bytes_received;
-    } else {
-      printf("Bad BulkInTransferInternal\r\n");
+  // Whole packets at the front of an aligned, reachable destination are
+  // read in place; the remainder goes through the bounce buffers.
+  const uint32_t direct_length =
+      transport_->CanTransferInPlace(data, data_length, kBulkInAlignment)
+          ? data_length - data_length % kBulkInPacketSize
+          : 0;
+
+  // Bulk-in data is a stream, so completed chunks are appended in order even
+  // if one of them comes back short.
+  uint32_t bytes_received = 0;
+  uint32_t bytes_requested = 0;
+  int in_flight = 0;
+  int oldest = next_transfer_;
+  while (bytes_received < data_length) {
+    while (in_flight < kMaxInFlightTransfers &&
+           bytes_received + bytes_requested < data_length) {
+      const uint32_t offset = bytes_received + bytes_requested;
+      BulkTransfer *transfer = NextTransfer();
+      uint32_t chunk_size;
+      if (offset < direct_length) {
+        chunk_size = std::min(kMaxBulkBufferSize, direct_length - offset);
+        transfer->data = data + offset;
+      } else {
+        chunk_size = std::min(kMaxBulkBufferSize, data_length - offset);
+        transfer->data = transfer->buffer;
+      }
+      if (!SubmitBulkIn(transfer, chunk_size)) {
+        return false;
+      }
+      bytes_requested += chunk_size;
+      ++in_flight;
+    }
+
+    BulkTransfer *transfer = &transfers_[oldest];
+    oldest = (oldest + 1) % kMaxInFlightTransfers;
+    --in_flight;
+    if (!WaitForTransfer(transfer) || transfer->transferred == 0) {
+      printf("Bad BulkInTransfer\r\n");
+      FlushSends();
       return false;
     }
+    if (transfer->data == transfer->buffer) {
+      memcpy(data + bytes_received, transfer->buffer, transfer->transferred);
+    } else {
+      // A short read in place leaves the next queued read at the wrong
+      // offset.
+      if (transfer->transferred != transfer->length && in_flight > 0) {
+        printf("Short BulkInTransfer\r\n");
+        FlushSends();
+        return false;
+      }
+    }
+    bytes_received += transfer->transferred;
+    bytes_requested -= transfer->length;
   }
   return true;
 }
 
-std::vector<uint8_t> TpuDriver::PrepareHeader(DescriptorTag tag,
-                                              uint32_t length) const {
-  constexpr size_t kPacketHeaderRawDataSizeInBytes = 8;
-  constexpr size_t kLengthSizeInBytes = sizeof(length);
-  std::vector<uint8_t> header_packet(kPacketHeaderRawDataSizeInBytes);
-  std::fill(header_packet.begin(), header_packet.end(), 0);
-  memcpy(header_packet.data(), &length, kLengthSizeInBytes);
-
-  *(header_packet.data() + sizeof(kLengthSizeInBytes)) =
-      (static_cast<uint8_t>(tag) & 0xF);
+void TpuDriver::PrepareHeader(DescriptorTag tag, uint32_t length,
+                              uint8_t *header) const {
+  memset(header, 0, kPacketHeaderSizeBytes);
+  memcpy(header, &length, sizeof(length));
+  header[sizeof(length)] = static_cast<uint8_t>(tag) & 0xF;
+}
 
-  return header_packet;
+bool TpuDriver::WriteHeader(DescriptorTag tag, uint32_t length) {
+  uint8_t header[kPacketHeaderSizeBytes];
+  PrepareHeader(tag, length, header);
+  // The header lives on the stack, so it has to be copied before returning.
+  return BulkOutTransfer(header, sizeof(header), /*stage=*/true);
 }
 
-bool TpuDriver::WriteHeader(DescriptorTag tag, uint32_t length) const {
-  std::vector<uint8_t> header_packet = PrepareHeader(tag, length);
-  return BulkOutTransfer(header_packet.data(), header_packet.size());
+bool TpuDriver::SubmitReadEvent() {
+  if (event_.pending) {
+    return true;
+  }
+  // For now, we don't do anything with the event's contents (address,
+  // length and descriptor tag).
+  event_.data = event_.buffer;
+  event_.length = kEventSizeBytes;
+  event_.ok = false;
+  event_.transferred = 0;
+  if (!transport_->ReadEvent(&event_)) {
+    return false;
+  }
+  event_.pending = true;
+  return true;
 }
 
-bool TpuDriver::ReadEvent() const {
-  bool ret = false;
-  constexpr size_t kEventSizeBytes = 16;
-  uint8_t *buf = (uint8_t *)OSA_MemoryAllocate(kEventSizeBytes);
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, kEventInEndpoint, buf, kEventSizeBytes,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        uint32_t len;
-        uint64_t address;
-        uint8_t tag;
-        memcpy(&address, data, sizeof(address));
-        memcpy(&len, data + sizeof(address), sizeof(len));
-        tag = *(data + sizeof(address) + sizeof(len)) & 0xF;
-        // For now, we don't do anything with these events we've read back.
-        (void)tag;
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
-      },
-      sema);
-  if (bulk_status != kStatus_USB_Success) {
-    printf("ReadEvent failed\r\n");
-    goto exit;
-  }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    goto exit;
-  };
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
-  OSA_MemoryFree(buf);
-  return ret;
+bool TpuDriver::WaitForEvent() {
+  if (!event_.pending) {
+    return false;
+  }
+  // The event is only raised once every queued send has been consumed.
+  bool ret = FlushSends();
+  event_.pending = false;
+  if (xSemaphoreTake(event_.sema, kTransferTimeout) == pdFALSE) {
+    printf("%s timed out\r\n", __func__);
+    // Cancel the read, so a late event can't complete the next one, and
+    // drop the completion if it raced with the cancel.
+    transport_->CancelEvent();
+    xSemaphoreTake(event_.sema, 0);
+    return false;
+  }
+  return ret && event_.ok;
 }
 
+bool TpuDriver::ReadEvent() { return SubmitReadEvent() && WaitForEvent(); }
+
 bool TpuDriver::DoRunControl(platforms::darwinn::driver::RunControl run_state) {
   const uint64_t run_state_value = static_cast<uint64_t>(run_state);
   CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
@@ -495,10 +634,9 @@ bool TpuDriver::DoRunControl(platforms::darwinn::driver::RunControl run_state) {
   // tiles, but hardware does not guarantee correct ordering with previous
   // write.
   uint64_t tileconfig0_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tileconfig0_reg));
-  } while (tileconfig0_reg != helper.raw());
+  CHECK(Poll(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+             &tileconfig0_reg,
+             [&](uint64_t reg) { return reg == helper.raw(); }));
 
   if (chip_config_.GetTileCsrOffsets().opRunControl !=
       static_cast<uint64_t>(-1)) {
@@ -656,7 +794,7 @@ bool TpuDriver::DoRunControl(platforms::darwinn::driver::RunControl run_state) {
                   run_state_value));
   }
 
-  return true;
+  return FlushCsr();
 }
 
 float TpuDriver::GetTemperature() {
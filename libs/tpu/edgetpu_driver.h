@@ -18,11 +18,12 @@
 #define LIBS_TPU_EDGETPU_DRIVER_H_
 
 #include <cstdint>
-#include <vector>
 
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/hardware_structures.h"
-#include "libs/tpu/usb_host_edgetpu.h"
+#include "libs/tpu/edgetpu_transport.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
 
 namespace coralmicro {
 
@@ -32,6 +33,7 @@ enum class PerformanceMode {
   kHigh,
   kMax,
 };
+inline constexpr int kPerformanceModeCount = 4;
 
 enum class DescriptorTag {
   kUnknown = -1,
@@ -45,19 +47,63 @@ enum class DescriptorTag {
   kInterrupt3 = 7,
 };
 
+// Copies `length` bytes from `src` to `dst`, XORing every 32-bit word with
+// `xor_mask` (little endian, aligned to the start of `dst`). Used to flip the
+// sign bits of signed tensors on the fly.
+void CopyWithXorMask(uint8_t* dst, const uint8_t* src, uint32_t length,
+                     uint32_t xor_mask);
+
+// Bulk transfers to and from the Edge TPU are pipelined: up to
+// `kMaxInFlightTransfers` chunks are queued on the USB link at once.
+// `SendParameters()`, `SendInputs()` and `SendInstructions()` return as soon
+// as their data is queued, and `GetOutputs()` drains any pending sends before
+// reading.
+//
+// Memory that the transport can reach (for USB: DTCM, OCRAM and SDRAM) is
+// transferred in place: sends from such memory must stay unchanged until
+// `FlushSends()`, `GetOutputs()` or `WaitForEvent()` returns, and reads into
+// it should start on a `kBulkInAlignment` boundary to avoid a copy. Anything
+// else is staged through per-slot bounce buffers.
 class TpuDriver {
  public:
+  // Number of bulk transfers kept in flight on the USB link.
+  static constexpr int kMaxInFlightTransfers = 2;
+  // Alignment of `GetOutputs()` destinations that are read into directly.
+  static constexpr uint32_t kBulkInAlignment = 32;
+  // Number of register accesses kept in flight on the control pipe. Each
+  // takes three of the EHCI driver's `USB_HOST_CONFIG_EHCI_MAX_QTD` (8) qTDs
+  // (setup, data and status), so two leaves room for the event read and a
+  // bulk transfer.
+  static constexpr int kMaxCsrInFlight = 2;
+
   TpuDriver() = default;
   TpuDriver(const TpuDriver&) = delete;
   TpuDriver& operator=(const TpuDriver&) = delete;
-  bool Initialize(usb_host_edgetpu_instance_t* usb_instance,
-                  PerformanceMode mode);
-  bool SendParameters(const uint8_t* data, uint32_t length) const;
-  bool SendInputs(const uint8_t* data, uint32_t length) const;
-  bool SendInstructions(const uint8_t* data, uint32_t length) const;
-  bool GetOutputs(uint8_t* data, uint32_t length) const;
-  bool ReadEvent() const;
+  // Brings up the Edge TPU behind `transport`, which must outlive this
+  // driver or the next call to `Initialize()`.
+  bool Initialize(EdgeTpuTransport* transport, PerformanceMode mode);
+  // Changes the Edge TPU clocks. This takes the chip through reset, which
+  // drops any cached parameters, so it should only be done between invokes.
+  bool SetPerformanceMode(PerformanceMode mode);
+  PerformanceMode performance_mode() const { return mode_; }
+  bool SendParameters(const uint8_t* data, uint32_t length);
+  // Inputs sent with a non-zero `xor_mask` are copied through
+  // `CopyWithXorMask()` while they are staged, leaving `data` untouched.
+  bool SendInputs(const uint8_t* data, uint32_t length, uint32_t xor_mask = 0);
+  bool SendInstructions(const uint8_t* data, uint32_t length);
+  bool GetOutputs(uint8_t* data, uint32_t length);
+  // Waits for all queued bulk-out transfers to complete.
+  bool FlushSends();
+  // Queues a read of the next completion event without waiting for it. If a
+  // read is already queued, this is a no-op.
+  bool SubmitReadEvent();
+  // Waits for the event read queued by `SubmitReadEvent()`.
+  bool WaitForEvent();
+  // Reads the next completion event, blocking until it arrives.
+  bool ReadEvent();
   float GetTemperature();
+  // Time taken by the last chip bring-up, in microseconds.
+  uint32_t bring_up_us() const { return bring_up_us_; }
 
  private:
   enum class RegisterSize {
@@ -65,26 +111,64 @@ class TpuDriver {
     kRegSize64,
   };
 
-  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length) const;
-  ssize_t BulkOutTransferInternal(uint8_t endpoint, const uint8_t* data,
-                                  uint32_t data_length) const;
-  bool BulkInTransfer(uint8_t* data, uint32_t data_length) const;
-  ssize_t BulkInTransferInternal(uint8_t endpoint, uint8_t* data,
-                                 uint32_t data_length) const;
+  // One queued transfer and the bounce buffer backing it. `data` points at
+  // either `buffer` or caller memory.
+  struct BulkTransfer : EdgeTpuTransfer {
+    SemaphoreHandle_t sema = nullptr;
+    // Bounce buffer owned by this slot.
+    uint8_t* buffer = nullptr;
+    bool pending = false;
+  };
+
+  bool InitializeTransfers();
+  // Resets the chip and brings it up at `mode`.
+  bool Configure(PerformanceMode mode);
+  bool SubmitBulkOut(BulkTransfer* transfer, uint32_t length);
+  bool SubmitBulkIn(BulkTransfer* transfer, uint32_t length);
+  bool WaitForTransfer(BulkTransfer* transfer);
+  BulkTransfer* NextTransfer();
+
+  // Sends `data`, copying it into the bounce buffers when `stage` is set,
+  // when `xor_mask` is non-zero, or when the transport can't reach it.
+  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length,
+                       bool stage = false, uint32_t xor_mask = 0);
+  bool BulkInTransfer(uint8_t* data, uint32_t data_length);
 
-  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length) const;
-  bool WriteHeader(DescriptorTag tag, uint32_t length) const;
-  std::vector<uint8_t> PrepareHeader(DescriptorTag tag, uint32_t length) const;
+  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length,
+                uint32_t xor_mask = 0);
+  bool WriteHeader(DescriptorTag tag, uint32_t length);
+  static constexpr size_t kPacketHeaderSizeBytes = 8;
+  void PrepareHeader(DescriptorTag tag, uint32_t length,
+                     uint8_t* header) const;
 
-  bool CSRTransfer(uint64_t reg, void* data, bool read, RegisterSize reg_size);
+  // Register accesses are queued on the control pipe, up to
+  // `kMaxCsrInFlight` at a time. Writes return once queued; a read waits for
+  // its own result, which also means every earlier access has completed. A
+  // failed write is reported by the next access that reuses its slot, or by
+  // `FlushCsr()`.
+  bool SubmitCsr(uint64_t reg, const void* data, bool read,
+                 RegisterSize reg_size, BulkTransfer** csr);
   bool Read32(uint64_t reg, uint32_t* val);
   bool Read64(uint64_t reg, uint64_t* val);
   bool Write32(uint64_t reg, uint32_t val);
   bool Write64(uint64_t reg, uint64_t val);
+  // Waits for every queued register write.
+  bool FlushCsr();
+  // Reads `reg` into `val` until `done(*val)` holds, giving up after
+  // `kCsrPollTimeoutUs`.
+  template <typename T, typename Done>
+  bool Poll(uint64_t reg, T* val, Done done);
   bool DoRunControl(platforms::darwinn::driver::RunControl run_state);
 
   platforms::darwinn::driver::config::BeagleChipConfig chip_config_;
-  usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  EdgeTpuTransport* transport_ = nullptr;
+  BulkTransfer csr_[kMaxCsrInFlight];
+  int next_csr_ = 0;
+  uint32_t bring_up_us_ = 0;
+  PerformanceMode mode_ = PerformanceMode::kHigh;
+  BulkTransfer transfers_[kMaxInFlightTransfers];
+  int next_transfer_ = 0;
+  BulkTransfer event_;
 };
 
 }  // namespace coralmicro
@@ -16,6 +16,9 @@
 
 #include "libs/tpu/edgetpu_executable.h"
 
+#include <algorithm>
+
+#include "libs/base/timer.h"
 #include "tensorflow/lite/micro/kernels/kernel_util.h"
 
 namespace {
@@ -47,126 +50,255 @@ namespace coralmicro {
 EdgeTpuExecutable::EdgeTpuExecutable(const platforms::darwinn::Executable* exe)
     : executable_(exe) {
   if (executable_->output_layers()) {
+    output_layers_.reserve(executable_->output_layers()->size());
     for (const auto* output_layer : *(executable_->output_layers())) {
-      output_layers_[output_layer->name()->c_str()] =
-          new OutputLayer(output_layer);
+      output_layers_.push_back(
+          std::make_unique<OutputLayer>(output_layer, batch_size()));
     }
+    output_targets_.resize(output_layers_.size(), OutputTarget{nullptr, false});
   }
+  BuildPlan();
 }
 
-EdgeTpuExecutable::~EdgeTpuExecutable() {
-  for (auto entry : output_layers_) {
-    delete entry.second;
-  }
-}
-
-#define RETURN_IF_ERROR(expr) \
-  do {                        \
-    bool ret = expr;          \
-    if (!ret) {               \
-      return kTfLiteError;    \
-    }                         \
-  } while (0);
-
-TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
-                                       TfLiteContext* context,
-                                       TfLiteNode* node) {
-  const TfLiteEvalTensor* input_tensor =
-      tflite::micro::GetEvalInput(context, node, 0);
-  const int input_size = tflite::micro::GetTensorShape(input_tensor).FlatSize();
-  if (!input_tensor) {
-    return kTfLiteError;
+void EdgeTpuExecutable::BuildPlan() {
+  if (!executable_->dma_hints() || !executable_->dma_hints()->hints()) {
+    return;
   }
-
-  const platforms::darwinn::DmaDescriptorHint* dma_hint;
-  const char* name;
-  uint8_t* output;
-  int32_t ins_idx;
-  const flatbuffers::Vector<uint8_t>* bitstream;
-
-  for (const auto* hint : *(executable_->dma_hints()->hints())) {
+  const auto* hints = executable_->dma_hints()->hints();
+  plan_.reserve(hints->size());
+  for (const auto* hint : *hints) {
+    Step step{};
     switch (hint->any_hint_type()) {
-      case platforms::darwinn::AnyHint_DmaDescriptorHint:
-        dma_hint = hint->any_hint_as_DmaDescriptorHint();
+      case platforms::darwinn::AnyHint_DmaDescriptorHint: {
+        const auto* dma_hint = hint->any_hint_as_DmaDescriptorHint();
+        const char* name;
+        step.length = dma_hint->size_in_bytes();
         switch (dma_hint->meta()->desc()) {
           case platforms::darwinn::Description_BASE_ADDRESS_PARAMETER:
-            RETURN_IF_ERROR(tpu_driver.SendParameters(
-                executable_->parameters()->data() + dma_hint->offset_in_bytes(),
-                dma_hint->size_in_bytes()));
+            step.type = Step::Type::kParameters;
+            step.data =
+                executable_->parameters()->data() + dma_hint->offset_in_bytes();
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_INPUT_ACTIVATION:
-            name = dma_hint->meta()->name()->c_str();
-            if (executable_->input_layers()) {
-              for (const auto* input_layer : *(executable_->input_layers())) {
-                if (!strcmp(input_layer->name()->c_str(), name)) {
-                  if (OutputLayer::SignedDataType(input_layer->data_type())) {
-                    OutputLayer::TransformSignedDataType(
-                        input_tensor->data.uint8, input_size,
-                        TensorDataTypeSize(input_layer->data_type()),
-                        input_layer->x_dim(), input_layer->y_dim(),
-                        input_layer->z_dim());
-                  }
-                }
-              }
+            step.type = Step::Type::kInputs;
+            if (!ResolveInput(dma_hint->meta()->name()->c_str(),
+                              dma_hint->meta()->batch(),
+                              dma_hint->offset_in_bytes(), &step)) {
+              continue;
             }
-            RETURN_IF_ERROR(tpu_driver.SendInputs(
-                input_tensor->data.uint8 + dma_hint->offset_in_bytes(),
-                dma_hint->size_in_bytes()));
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_OUTPUT_ACTIVATION:
+            step.type = Step::Type::kOutputs;
             name = dma_hint->meta()->name()->c_str();
-            if (output_layers_.find(name) == output_layers_.end()) {
+            for (const auto& output_layer : output_layers_) {
+              if (!strcmp(output_layer->name(), name)) {
+                step.output_layer = output_layer.get();
+                break;
+              }
+            }
+            if (!step.output_layer) {
               printf("Executable does not have output layer %s\r\n", name);
-              break;
+              continue;
             }
-            output = output_layers_.at(name)->output_buffer();
-            RETURN_IF_ERROR(
-                tpu_driver.GetOutputs(output, dma_hint->size_in_bytes()));
+            step.offset =
+                step.output_layer->BatchOffset(dma_hint->meta()->batch()) +
+                dma_hint->offset_in_bytes();
             break;
           default:
-            break;
+            continue;
         }
         break;
-      case platforms::darwinn::AnyHint_InstructionHint:
-        ins_idx =
-            hint->any_hint_as_InstructionHint()->instruction_chunk_index();
-        bitstream =
-            executable_->instruction_bitstreams()->Get(ins_idx)->bitstream();
-        RETURN_IF_ERROR(
-            tpu_driver.SendInstructions(bitstream->data(), bitstream->size()));
+      }
+      case platforms::darwinn::AnyHint_InstructionHint: {
+        const auto* bitstream =
+            executable_->instruction_bitstreams()
+                ->Get(hint->any_hint_as_InstructionHint()
+                          ->instruction_chunk_index())
+                ->bitstream();
+        step.type = Step::Type::kInstructions;
+        step.data = bitstream->data();
+        step.length = bitstream->size();
         break;
+      }
       default:
+        continue;
+    }
+    plan_.push_back(step);
+  }
+}
+
+bool EdgeTpuExecutable::ResolveInput(const char* name, int batch,
+                                     uint32_t offset, Step* step) {
+  const auto* input_layers = executable_->input_layers();
+  if (input_layers) {
+    for (uint32_t i = 0; i < input_layers->size(); ++i) {
+      const auto* input_layer = input_layers->Get(i);
+      if (strcmp(input_layer->name()->c_str(), name)) {
+        continue;
+      }
+      // Batches are packed in the input tensor without device padding.
+      const uint32_t batch_bytes =
+          input_layer->x_dim() * input_layer->y_dim() * input_layer->z_dim() *
+          TensorDataTypeSize(input_layer->data_type()) *
+          input_layer->execution_count_per_inference();
+      step->offset = batch * batch_bytes + offset;
+      step->input_index = i;
+      step->input_sign_mask = OutputLayer::SignMask(input_layer->data_type());
+      input_count_ = std::max(input_count_, static_cast<int>(i) + 1);
+      return true;
+    }
+  }
+  printf("Executable does not have input layer %s\r\n", name);
+  return false;
+}
+
+void EdgeTpuExecutable::DumpPlan() const {
+  printf("Edge TPU plan: %u steps\r\n", static_cast<unsigned>(plan_.size()));
+  for (size_t i = 0; i < plan_.size(); ++i) {
+    const Step& step = plan_[i];
+    switch (step.type) {
+      case Step::Type::kParameters:
+        printf("%3u parameters   %p %lu\r\n", static_cast<unsigned>(i),
+               step.data, static_cast<unsigned long>(step.length));
+        break;
+      case Step::Type::kInputs:
+        printf("%3u inputs       %lu+%lu %lu\r\n", static_cast<unsigned>(i),
+               static_cast<unsigned long>(step.input_index),
+               static_cast<unsigned long>(step.offset),
+               static_cast<unsigned long>(step.length));
+        break;
+      case Step::Type::kInstructions:
+        printf("%3u instructions %p %lu\r\n", static_cast<unsigned>(i),
+               step.data, static_cast<unsigned long>(step.length));
+        break;
+      case Step::Type::kOutputs:
+        printf("%3u outputs      %s+%lu %lu\r\n", static_cast<unsigned>(i),
+               step.output_layer->name(),
+               static_cast<unsigned long>(step.offset),
+               static_cast<unsigned long>(step.length));
         break;
     }
   }
+}
+
+#define RETURN_IF_ERROR(expr) \
+  do {                        \
+    bool ret = expr;          \
+    if (!ret) {               \
+      return kTfLiteError;    \
+    }                         \
+  } while (0);
+
+TfLiteStatus EdgeTpuExecutable::Invoke(TpuDriver& tpu_driver,
+                                       TfLiteContext* context,
+                                       TfLiteNode* node,
+                                       EdgeTpuProfiler* profiler) {
+  if (node->inputs->size < input_count_) {
+    printf("Executable expects %d inputs, got %d\r\n", input_count_,
+           node->inputs->size);
+    return kTfLiteError;
+  }
 
-  tpu_driver.ReadEvent();
+  // Queue the completion event read up front, so it is collected by the USB
+  // host while outputs are read back and relaid out.
+  RETURN_IF_ERROR(tpu_driver.SubmitReadEvent());
+
+  uint64_t phase_start = profiler ? TimerMicros() : 0;
+  auto record_phase = [&](EdgeTpuPhase phase, uint32_t bytes) {
+    if (!profiler) return;
+    const uint64_t now = TimerMicros();
+    profiler->Record(phase, static_cast<uint32_t>(now - phase_start), bytes);
+    phase_start = now;
+  };
+  // Sends only queue their data, so the time until they have drained is
+  // charged to the last one when profiling.
+  EdgeTpuPhase last_send_phase = EdgeTpuPhase::kInstructions;
+
+  for (const Step& step : plan_) {
+    switch (step.type) {
+      case Step::Type::kParameters:
+        RETURN_IF_ERROR(tpu_driver.SendParameters(step.data, step.length));
+        last_send_phase = EdgeTpuPhase::kParameters;
+        break;
+      case Step::Type::kInputs: {
+        const TfLiteEvalTensor* input_tensor =
+            tflite::micro::GetEvalInput(context, node, step.input_index);
+        if (!input_tensor) {
+          return kTfLiteError;
+        }
+        RETURN_IF_ERROR(
+            tpu_driver.SendInputs(input_tensor->data.uint8 + step.offset,
+                                  step.length, step.input_sign_mask));
+        last_send_phase = EdgeTpuPhase::kInputs;
+        break;
+      }
+      case Step::Type::kInstructions:
+        RETURN_IF_ERROR(tpu_driver.SendInstructions(step.data, step.length));
+        last_send_phase = EdgeTpuPhase::kInstructions;
+        break;
+      case Step::Type::kOutputs:
+        if (profiler) {
+          RETURN_IF_ERROR(tpu_driver.FlushSends());
+          record_phase(last_send_phase, 0);
+        }
+        RETURN_IF_ERROR(tpu_driver.GetOutputs(
+            step.output_layer->output_buffer() + step.offset, step.length));
+        record_phase(EdgeTpuPhase::kOutputs, step.length);
+        continue;
+    }
+    record_phase(last_send_phase, step.length);
+  }
 
+  // All output data has been read back at this point, so relayout can proceed
+  // while the completion event is still in flight.
   if (!output_layers_.empty()) {
+    if (node->outputs->size > static_cast<int>(output_layers_.size())) {
+      printf("Executable does not have buffers for %d outputs\r\n",
+             node->outputs->size);
+      return kTfLiteError;
+    }
     for (int i = 0; i < node->outputs->size; ++i) {
       const TfLiteEvalTensor* output_tensor =
           tflite::micro::GetEvalOutput(context, node, i);
-      const int output_size =
-          tflite::micro::GetTensorShape(output_tensor).FlatSize();
       if (!output_tensor) {
         return kTfLiteError;
       }
-      name = executable_->output_layers()->Get(i)->name()->c_str();
-      if (output_layers_.find(name) == output_layers_.end()) {
-        printf("Executable does not have buffer for %s\r\n", name);
-        return kTfLiteError;
+      output_targets_[i] = {output_tensor->data.uint8, lazy_outputs_};
+      if (!lazy_outputs_) {
+        output_layers_[i]->Relayout(output_tensor->data.uint8);
       }
-      OutputLayer* output_layer = output_layers_[name];
-
-      output_layer->Relayout(output_tensor->data.uint8);
-      output_layer->TransformSignedDataType(output_tensor->data.uint8,
-                                            output_size);
+    }
+    if (!lazy_outputs_) {
+      record_phase(EdgeTpuPhase::kRelayout, 0);
     }
   }
 
+  RETURN_IF_ERROR(tpu_driver.WaitForEvent());
+  record_phase(EdgeTpuPhase::kWaitEvent, 0);
+
   return kTfLiteOk;
 }
 
+bool EdgeTpuExecutable::RelayoutOutput(const void* dest) {
+  for (size_t i = 0; i < output_targets_.size(); ++i) {
+    OutputTarget& target = output_targets_[i];
+    if (target.dest != dest) {
+      continue;
+    }
+    if (target.pending) {
+      output_layers_[i]->Relayout(target.dest);
+      target.pending = false;
+    }
+    return true;
+  }
+  return false;
+}
+
+void EdgeTpuExecutable::ClearOutputTargets() {
+  std::fill(output_targets_.begin(), output_targets_.end(),
+            OutputTarget{nullptr, false});
+}
+
 int OutputLayer::DataTypeSize() const {
   return TensorDataTypeSize(output_layer_->data_type());
 }
@@ -175,6 +307,19 @@ bool OutputLayer::SignedDataType() const {
   return SignedDataType(output_layer_->data_type());
 }
 
+uint32_t OutputLayer::SignMask(platforms::darwinn::DataType type) {
+  // The masks repeat every element, so they line up with any buffer that
+  // starts on an element boundary.
+  switch (type) {
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT8:
+      return 0x80808080;
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT16:
+      return 0x80008000;
+    default:
+      return 0;
+  }
+}
+
 bool OutputLayer::SignedDataType(platforms::darwinn::DataType type) {
   switch (type) {
     case platforms::darwinn::DataType_SIGNED_FIXED_POINT8:
@@ -197,145 +342,193 @@ bool OutputLayer::SignedDataType(platforms::darwinn::DataType type) {
   return false;
 }
 
-void OutputLayer::Relayout(uint8_t* dest) const {
-  uint8_t* src = output_buffer_.get();
+void OutputLayer::AddCopyRun(uint32_t src_offset, uint32_t dst_offset,
+                             uint32_t length) {
+  if (!copy_runs_.empty()) {
+    CopyRun& last = copy_runs_.back();
+    const uint32_t last_src_end =
+        last.src_offset + last.length / run_z_bytes_ * run_src_stride_;
+    if (last_src_end == src_offset &&
+        last.dst_offset + last.length == dst_offset) {
+      last.length += length;
+      return;
+    }
+  }
+  copy_runs_.push_back({src_offset, dst_offset, length});
+}
+
+void OutputLayer::BuildCopyRuns() {
+  sign_mask_ = SignedDataType() ? SignMask(output_layer_->data_type()) : 0;
   const auto data_type_size = DataTypeSize();
   const int z_bytes = z_dim() * data_type_size;
+  if (z_bytes == 0) {
+    return;
+  }
 
   if (y_dim() == 1 && x_dim() == 1) {
     // One dimensional output (only z-dimension).
-    if (src != dest) {
-      const int padded_size_bytes = PaddedSizeBytes();
-      const int actual_size_bytes = ActualSizeBytes();
-      const int executions = execution_count_per_inference();
-      if (executions == 1 || padded_size_bytes == actual_size_bytes) {
-        memcpy(dest, src, z_bytes * executions);
-      } else {
-        // Remove padding values at the end of each execution.
-        const int padded_size_per_execution =
-            (padded_size_bytes - actual_size_bytes) / executions;
-        for (int i = 0; i < executions; ++i) {
-          memcpy(dest, src, z_bytes);
-          dest += z_bytes;
-          src += z_bytes + padded_size_per_execution;
-        }
-      }
-    }
-  } else {
-    int z_bytes_padded;
-    if (x_dim() > 1) {
-      // If x-dim is > 1, padded-z-size can be deduced by looking at
-      // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
-      z_bytes_padded = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
+    copy_kernel_ = CopyKernel::kContiguous;
+    run_z_bytes_ = run_src_stride_ = z_bytes;
+    const int padded_size_bytes = PaddedSizeBytes();
+    const int actual_size_bytes = ActualSizeBytes();
+    const int executions = execution_count_per_inference();
+    if (executions == 1 || padded_size_bytes == actual_size_bytes) {
+      AddCopyRun(0, 0, z_bytes * executions);
     } else {
-      // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
-      // padded-z-size can be deduced by looking at difference between
-      // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
-      z_bytes_padded = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+      // Remove padding values at the end of each execution.
+      const int padded_size_per_execution =
+          (padded_size_bytes - actual_size_bytes) / executions;
+      for (int i = 0; i < executions; ++i) {
+        AddCopyRun(i * (z_bytes + padded_size_per_execution), i * z_bytes,
+                   z_bytes);
+      }
     }
-    z_bytes_padded *= data_type_size;
-
-    const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
-    int last_x = 0;
-    size_t active_tile_x_count = 0;
+    return;
+  }
 
-    int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+  int z_bytes_padded;
+  if (x_dim() > 1) {
+    // If x-dim is > 1, padded-z-size can be deduced by looking at
+    // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
+    z_bytes_padded = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
+  } else {
+    // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
+    // padded-z-size can be deduced by looking at difference between
+    // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
+    z_bytes_padded = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+  }
+  z_bytes_padded *= data_type_size;
+
+  // Grayscale and RGB outputs are always padded to 4 bytes.
+  run_z_bytes_ = z_bytes;
+  if (z_bytes == 1) {
+    copy_kernel_ = CopyKernel::kGather1;
+    run_src_stride_ = 4;
+  } else if (z_bytes == 3) {
+    copy_kernel_ = CopyKernel::kGather3;
+    run_src_stride_ = 4;
+  } else if (z_bytes == z_bytes_padded) {
+    copy_kernel_ = CopyKernel::kContiguous;
+    run_src_stride_ = z_bytes;
+  } else {
+    copy_kernel_ = CopyKernel::kGather;
+    run_src_stride_ = z_bytes_padded;
+  }
 
-    for (int x = 1; x < x_dim(); ++x) {
-      int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
-      if (cur_x_tile != last_x_tile) {
-        active_tile_x_sizes_[active_tile_x_count] = x - last_x;
-        active_tile_x_count++;
-        last_x_tile = cur_x_tile;
-        last_x = x;
-      }
+  // Runs of x that map to the same tile.
+  const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
+  std::vector<int> tile_x_sizes;
+  int last_x = 0;
+  int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+  for (int x = 1; x < x_dim(); ++x) {
+    int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+    if (cur_x_tile != last_x_tile) {
+      tile_x_sizes.push_back(x - last_x);
+      last_x_tile = cur_x_tile;
+      last_x = x;
     }
-    active_tile_x_sizes_[active_tile_x_count] = x_dim() - last_x;
-    active_tile_x_count++;
-
-    // When the num_z_bytes parameter is a compile-time constant, the
-    // conditions in the innermost loop will be replaced with a single
-    // optimized path, specialized for that value. Specialization is
-    // provided for num_z_bytes value of 1 and 3. We can also make this a
-    // helper function and still realize the benefits provided we have a
-    // guaranteed way of ensuring this function would be inlined so that the
-    // compiler optimizations based on compile-time-constants can kick in.
-#define RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(num_z_bytes, num_z_bytes_padded) \
-  do {                                                                        \
-    for (int y = 0; y < y_dim(); ++y) {                                       \
-      const auto y_buffer_index = GetYBufferIndex(y);                         \
-      int tile_starting_x = 0;                                                \
-      for (size_t x_tile = 0; x_tile < active_tile_x_count; ++x_tile) {       \
-        const unsigned char* source =                                         \
-            src + GetBufferIndex(y_buffer_index, tile_starting_x, 0) *        \
-                      data_type_size;                                         \
-        const int tile_x_size = active_tile_x_sizes_[x_tile];                 \
-        for (int local_offset_x = 0; local_offset_x < tile_x_size;            \
-             ++local_offset_x) {                                              \
-          if ((num_z_bytes) == 1) {                                           \
-            *dest = *source;                                                  \
-          } else if ((num_z_bytes) == 3) {                                    \
-            *(dest + 0) = *(source + 0);                                      \
-            *(dest + 1) = *(source + 1);                                      \
-            *(dest + 2) = *(source + 2);                                      \
-          } else {                                                            \
-            memcpy(dest, source, (num_z_bytes));                              \
-          }                                                                   \
-          dest += (num_z_bytes);                                              \
-          source += (num_z_bytes_padded);                                     \
-        }                                                                     \
-        tile_starting_x += tile_x_size;                                       \
-      }                                                                       \
-    }                                                                         \
-  } while (0)
-
-    if (z_bytes == 1) {
-      // Specialization for z_bytes = 1 (grayscale image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(1, 4);
-    } else if (z_bytes == 3) {
-      // Specialization for z_bytes = 3 (RGB image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(3, 4);
-    } else {
-      // Default.
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(z_bytes, z_bytes_padded);
+  }
+  tile_x_sizes.push_back(x_dim() - last_x);
+
+  uint32_t dst_offset = 0;
+  for (int y = 0; y < y_dim(); ++y) {
+    const auto y_buffer_index = GetYBufferIndex(y);
+    int tile_starting_x = 0;
+    for (const int tile_x_size : tile_x_sizes) {
+      const uint32_t src_offset =
+          GetBufferIndex(y_buffer_index, tile_starting_x, 0) * data_type_size;
+      const uint32_t length = tile_x_size * z_bytes;
+      AddCopyRun(src_offset, dst_offset, length);
+      dst_offset += length;
+      tile_starting_x += tile_x_size;
     }
-
-#undef RELAYOUT_WITH_Z_BYTES_SPECIALIZATION
   }
+  copy_runs_.shrink_to_fit();
 }
 
-void OutputLayer::TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                          int data_type_size, int x_dim,
-                                          int y_dim, int z_dim) {
-  int buffer_index = 0;
-
-  for (int y = 0; y < y_dim; ++y) {
-    for (int x = 0; x < x_dim; ++x) {
-      for (int z = 0; z < z_dim; ++z) {
-        // XORing with 128 on the last byte of each entry will flip the
-        // MSB of each entry. Please note that bytes are stored little
-        // endian.
-        int msb_index = buffer_index + data_type_size - 1;
-        buffer[msb_index] = buffer[msb_index] ^ 128;
-        buffer_index += data_type_size;
-      }
-    }
+namespace {
+// Copies every 4th byte of `src`, starting with the first.
+void Gather1(uint8_t* dst, const uint8_t* src, uint32_t count,
+             uint32_t xor_mask) {
+  for (; count >= 4; count -= 4) {
+    const uint32_t word = (src[0] | (src[4] << 8) | (src[8] << 16) |
+                           (static_cast<uint32_t>(src[12]) << 24)) ^
+                          xor_mask;
+    memcpy(dst, &word, sizeof(word));
+    dst += 4;
+    src += 16;
+  }
+  for (; count > 0; --count) {
+    *dst++ = *src ^ static_cast<uint8_t>(xor_mask);
+    src += 4;
   }
 }
 
-void OutputLayer::TransformSignedDataType(uint8_t* buffer,
-                                          int buffer_size) const {
-  if (!SignedDataType()) {
-    return;
+// Copies the low 3 bytes of every 4 byte word in `src`.
+void Gather3(uint8_t* dst, const uint8_t* src, uint32_t count,
+             uint32_t xor_mask) {
+  for (; count >= 4; count -= 4) {
+    uint32_t in[4];
+    memcpy(in, src, sizeof(in));
+    // Little endian: pack four 24-bit pixels into three words.
+    const uint32_t out[3] = {
+        ((in[0] & 0xFFFFFF) | (in[1] << 24)) ^ xor_mask,
+        (((in[1] >> 8) & 0xFFFF) | (in[2] << 16)) ^ xor_mask,
+        (((in[2] >> 16) & 0xFF) | (in[3] << 8)) ^ xor_mask,
+    };
+    memcpy(dst, out, sizeof(out));
+    dst += 12;
+    src += 16;
+  }
+  const auto xor_byte = static_cast<uint8_t>(xor_mask);
+  for (; count > 0; --count) {
+    dst[0] = src[0] ^ xor_byte;
+    dst[1] = src[1] ^ xor_byte;
+    dst[2] = src[2] ^ xor_byte;
+    dst += 3;
+    src += 4;
   }
+}
+}  // namespace
 
-  if (buffer_size < ActualSizeBytes()) {
-    printf("Provided buffer size is less than actual size_bytes.");
-    return;
+void OutputLayer::Relayout(uint8_t* dest) const {
+  for (int batch = 0; batch < batch_size_; ++batch) {
+    RelayoutBatch(output_buffer_ + BatchOffset(batch),
+                  dest + batch * ActualSizeBytes());
   }
+}
 
-  TransformSignedDataType(buffer, buffer_size, DataTypeSize(), x_dim(), y_dim(),
-                          z_dim());
+void OutputLayer::RelayoutBatch(const uint8_t* src, uint8_t* dest) const {
+  switch (copy_kernel_) {
+    case CopyKernel::kContiguous:
+      for (const auto& run : copy_runs_) {
+        CopyWithXorMask(dest + run.dst_offset, src + run.src_offset,
+                        run.length, sign_mask_);
+      }
+      break;
+    case CopyKernel::kGather1:
+      for (const auto& run : copy_runs_) {
+        Gather1(dest + run.dst_offset, src + run.src_offset, run.length,
+                sign_mask_);
+      }
+      break;
+    case CopyKernel::kGather3:
+      for (const auto& run : copy_runs_) {
+        Gather3(dest + run.dst_offset, src + run.src_offset, run.length / 3,
+                sign_mask_);
+      }
+      break;
+    case CopyKernel::kGather:
+      for (const auto& run : copy_runs_) {
+        uint8_t* d = dest + run.dst_offset;
+        const uint8_t* s = src + run.src_offset;
+        for (uint32_t i = 0; i < run.length; i += run_z_bytes_) {
+          CopyWithXorMask(d + i, s, run_z_bytes_, sign_mask_);
+          s += run_src_stride_;
+        }
+      }
+      break;
+  }
 }
 
 // Used in GetBufferIndex(int y, int x, int z)
@@ -17,11 +17,14 @@
 #ifndef LIBS_TPU_EDGETPU_EXECUTABLE_H_
 #define LIBS_TPU_EDGETPU_EXECUTABLE_H_
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
-#include <map>
+#include <memory>
+#include <vector>
 
 #include "libs/tpu/edgetpu_driver.h"
+#include "libs/tpu/edgetpu_profiler.h"
 #include "libs/tpu/executable_generated.h"
 #include "third_party/tflite-micro/tensorflow/lite/c/common.h"
 
@@ -29,22 +32,54 @@ namespace coralmicro {
 
 class OutputLayer {
  public:
-  explicit OutputLayer(const platforms::darwinn::Layer* layer)
+  // `batch_size` is the number of inputs the executable processes per
+  // invoke; the output buffer holds the device output for each of them.
+  explicit OutputLayer(const platforms::darwinn::Layer* layer,
+                       int batch_size = 1)
       : output_layer_(layer),
-        output_buffer_(std::make_unique<uint8_t[]>(layer->size_bytes())),
-        active_tile_x_sizes_(std::make_unique<int[]>(x_dim())) {}
+        batch_size_(batch_size),
+        output_buffer_storage_(std::make_unique<uint8_t[]>(
+            PaddedSizeBytes() * batch_size + TpuDriver::kBulkInAlignment - 1)),
+        output_buffer_(AlignOutputBuffer(output_buffer_storage_.get())) {
+    BuildCopyRuns();
+  }
   OutputLayer(const OutputLayer&) = delete;
   OutputLayer& operator=(const OutputLayer&) = delete;
-  uint8_t* output_buffer() { return output_buffer_.get(); }
+  uint8_t* output_buffer() { return output_buffer_; }
+  const char* name() const { return output_layer_->name()->c_str(); }
+  // Offset of batch `batch`'s device output in the output buffer.
+  uint32_t BatchOffset(int batch) const { return batch * PaddedSizeBytes(); }
 
   static bool SignedDataType(platforms::darwinn::DataType type);
-  static void TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                      int data_type_size, int x_dim, int y_dim,
-                                      int z_dim);
+  // Returns the word mask that flips the sign bit of every little endian
+  // element of `type`, or 0 for types that aren't converted.
+  static uint32_t SignMask(platforms::darwinn::DataType type);
+  // Copies the output buffer into `dest` in tensor order, converting signed
+  // types on the way. Batches are laid out one after the other.
   void Relayout(uint8_t* dest) const;
-  void TransformSignedDataType(uint8_t* buffer, int buffer_size) const;
 
  private:
+  // A span of the output buffer that lands contiguously in the relaid out
+  // tensor. `length` counts destination bytes.
+  struct CopyRun {
+    uint32_t src_offset;
+    uint32_t dst_offset;
+    uint32_t length;
+  };
+  // How each run is copied: straight, or by gathering `run_z_bytes_` wide
+  // z-vectors that are `run_src_stride_` bytes apart in the output buffer.
+  enum class CopyKernel : uint8_t {
+    kContiguous,
+    kGather1,
+    kGather3,
+    kGather,
+  };
+
+  void BuildCopyRuns();
+  // Relays out one batch's device output at `src` into `dest`.
+  void RelayoutBatch(const uint8_t* src, uint8_t* dest) const;
+  void AddCopyRun(uint32_t src_offset, uint32_t dst_offset, uint32_t length);
+
   struct YBufferIndex {
     // Holds the linearized tile ID for a given y value.
     int y_linearized_tile_id;
@@ -73,34 +108,112 @@ class OutputLayer {
   int y_dim() const { return output_layer_->y_dim(); }
   int z_dim() const { return output_layer_->z_dim(); }
 
+  // Aligned so the Edge TPU driver can read outputs without a bounce copy.
+  static uint8_t* AlignOutputBuffer(uint8_t* storage) {
+    const auto address = reinterpret_cast<uintptr_t>(storage);
+    return storage + (-address & (TpuDriver::kBulkInAlignment - 1));
+  }
+
   const platforms::darwinn::Layer* output_layer_;
-  std::unique_ptr<uint8_t[]> output_buffer_;
-  std::unique_ptr<int[]> active_tile_x_sizes_;
+  int batch_size_;
+  std::unique_ptr<uint8_t[]> output_buffer_storage_;
+  uint8_t* output_buffer_;
+  std::vector<CopyRun> copy_runs_;
+  CopyKernel copy_kernel_ = CopyKernel::kContiguous;
+  uint32_t run_z_bytes_ = 0;
+  uint32_t run_src_stride_ = 0;
+  uint32_t sign_mask_ = 0;
 };
 
 class EdgeTpuExecutable {
  public:
   explicit EdgeTpuExecutable(const platforms::darwinn::Executable* exe);
-  ~EdgeTpuExecutable();
   EdgeTpuExecutable(const EdgeTpuExecutable&) = delete;
   EdgeTpuExecutable& operator=(const EdgeTpuExecutable&) = delete;
 
-  TfLiteStatus Invoke(const TpuDriver& tpu_driver, TfLiteContext* context,
-                      TfLiteNode* node);
+  // Runs the executable, recording the time spent in each phase to
+  // `profiler` if it is non-null.
+  //
+  // The node's inputs and outputs follow the order of the executable's input
+  // and output layers. Executables compiled with a batch size above one take
+  // that many inputs back to back in each input tensor and run them all in a
+  // single submission, producing the outputs the same way.
+  TfLiteStatus Invoke(TpuDriver& tpu_driver, TfLiteContext* context,
+                      TfLiteNode* node, EdgeTpuProfiler* profiler = nullptr);
+
+  const char* name() const {
+    return executable_->name() ? executable_->name()->c_str() : "";
+  }
 
   uint64_t ParameterCachingToken() const {
     return executable_->parameter_caching_token();
   }
 
+  size_t ParameterBytes() const {
+    return executable_->parameters() ? executable_->parameters()->size() : 0;
+  }
+
+  // Number of inputs processed by each invoke.
+  int batch_size() const { return std::max(executable_->batch_size(), 1); }
+
+  // Prints the precompiled execution plan, one transfer per line.
+  void DumpPlan() const;
+
+  // Whether `Invoke()` leaves outputs in the Edge TPU layout until they are
+  // requested with `RelayoutOutput()`, instead of relaying them all out.
+  void set_lazy_outputs(bool lazy) { lazy_outputs_ = lazy; }
+  // Relays out the output of the last invoke that belongs in the tensor data
+  // at `dest`, if it hasn't been already. Returns false if `dest` isn't one of
+  // the last invoke's output tensors.
+  bool RelayoutOutput(const void* dest);
+  // Forgets the last invoke's outputs, so `RelayoutOutput()` no longer fills
+  // them in.
+  void ClearOutputTargets();
+
  private:
-  const platforms::darwinn::Executable* executable_;
+  // A single transfer with everything resolved from the executable's DMA
+  // hints, so that `Invoke()` doesn't have to walk the flatbuffer.
+  struct Step {
+    enum class Type : uint8_t {
+      kParameters,
+      kInputs,
+      kInstructions,
+      kOutputs,
+    };
+    Type type;
+    uint32_t length;
+    // Source of parameter and instruction transfers.
+    const uint8_t* data;
+    // Offset into the input tensor of input transfers, or into the output
+    // layer's buffer of output transfers.
+    uint32_t offset;
+    // The node input that input transfers read from, which is the input layer
+    // named by the transfer.
+    uint32_t input_index;
+    // Sign flip applied to input transfers as they are staged.
+    uint32_t input_sign_mask;
+    // Destination of output transfers.
+    OutputLayer* output_layer;
+  };
 
-  struct Less {
-    bool operator()(const char* a, const char* b) const {
-      return std::strcmp(a, b) < 0;
-    }
+  void BuildPlan();
+  // Resolves an input transfer named `name` for batch `batch` into `step`.
+  bool ResolveInput(const char* name, int batch, uint32_t offset, Step* step);
+
+  const platforms::darwinn::Executable* executable_;
+  // Number of node inputs that `Invoke()` reads.
+  int input_count_ = 0;
+  // Indexed like `executable_->output_layers()`.
+  std::vector<std::unique_ptr<OutputLayer>> output_layers_;
+  // Output tensor data each output layer was last invoked for, and whether
+  // it still has to be relaid out there. Indexed like `output_layers_`.
+  struct OutputTarget {
+    uint8_t* dest;
+    bool pending;
   };
-  std::map<const char*, OutputLayer*, Less> output_layers_;
+  std::vector<OutputTarget> output_targets_;
+  bool lazy_outputs_ = false;
+  std::vector<Step> plan_;
 };
 
 }  // namespace coralmicro
@@ -0,0 +1,146 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_governor.h"
+
+#include <algorithm>
+
+namespace coralmicro {
+namespace {
+PerformanceMode StepMode(PerformanceMode mode, int step) {
+  const int level = std::clamp(static_cast<int>(mode) + step, 0,
+                               kPerformanceModeCount - 1);
+  return static_cast<PerformanceMode>(level);
+}
+}  // namespace
+
+void EdgeTpuClockGovernor::Start(const EdgeTpuGovernorConfig& config,
+                                 PerformanceMode mode, uint64_t now_us) {
+  config_ = config;
+  enabled_ = true;
+  mode_ = mode;
+  mode_since_us_ = now_us;
+  last_change_us_ = now_us;
+  thermal_cap_ = config_.max_mode;
+  throttled_ = false;
+  temperature_valid_ = false;
+  window_start_us_ = now_us;
+  window_busy_us_ = 0;
+  utilization_ = 0.0f;
+}
+
+void EdgeTpuClockGovernor::Stop(uint64_t now_us) {
+  if (!enabled_) return;
+  AccountTime(now_us);
+  enabled_ = false;
+}
+
+bool EdgeTpuClockGovernor::TemperatureDue(uint64_t now_us) const {
+  return enabled_ &&
+         (!temperature_valid_ || now_us - last_temperature_us_ >=
+                                     config_.temperature_poll_ms * 1000ull);
+}
+
+void EdgeTpuClockGovernor::SetTemperature(float temperature_c,
+                                          uint64_t now_us) {
+  temperature_c_ = temperature_c;
+  temperature_valid_ = true;
+  last_temperature_us_ = now_us;
+
+  if (temperature_c >= config_.critical_temperature_c) {
+    if (thermal_cap_ != config_.min_mode) ++thermal_throttles_;
+    thermal_cap_ = config_.min_mode;
+    throttled_ = true;
+  } else if (temperature_c >= config_.throttle_temperature_c) {
+    // Step down relative to the running mode, so readings taken before the
+    // previous step has been applied don't compound.
+    const PerformanceMode cap =
+        std::max(StepMode(mode_, -1), config_.min_mode);
+    if (cap < thermal_cap_) {
+      thermal_cap_ = cap;
+      ++thermal_throttles_;
+    }
+    throttled_ = true;
+  } else if (throttled_ && temperature_c < config_.throttle_temperature_c -
+                                               config_.hysteresis_c) {
+    thermal_cap_ = config_.max_mode;
+    throttled_ = false;
+  }
+}
+
+PerformanceMode EdgeTpuClockGovernor::OnInvokeStart(PerformanceMode current,
+                                                    uint32_t backlog,
+                                                    uint64_t now_us) {
+  if (current != mode_) OnModeChanged(current, now_us);
+  invoke_start_us_ = now_us;
+
+  const uint64_t window_us = now_us - window_start_us_;
+  if (window_us >= config_.window_ms * 1000ull) {
+    utilization_ = static_cast<float>(window_busy_us_) / window_us;
+    window_start_us_ = now_us;
+    window_busy_us_ = 0;
+  }
+
+  PerformanceMode desired = mode_;
+  if (backlog > 0 || utilization_ > config_.raise_utilization) {
+    desired = StepMode(mode_, 1);
+  } else if (utilization_ < config_.lower_utilization) {
+    desired = StepMode(mode_, -1);
+  }
+  const PerformanceMode ceiling = std::min(config_.max_mode, thermal_cap_);
+  desired = std::clamp(desired, config_.min_mode,
+                       std::max(ceiling, config_.min_mode));
+
+  // Thermal limits apply right away; everything else waits out the dwell.
+  if (desired < mode_ && mode_ > ceiling) return desired;
+  if (now_us - last_change_us_ < config_.min_dwell_ms * 1000ull) return mode_;
+  return desired;
+}
+
+void EdgeTpuClockGovernor::OnInvokeEnd(uint64_t now_us) {
+  window_busy_us_ += now_us - invoke_start_us_;
+}
+
+void EdgeTpuClockGovernor::OnModeChanged(PerformanceMode mode,
+                                         uint64_t now_us) {
+  AccountTime(now_us);
+  if (mode != mode_) ++transitions_;
+  mode_ = mode;
+  last_change_us_ = now_us;
+  // Don't count the reset as busy time.
+  invoke_start_us_ = now_us;
+}
+
+EdgeTpuGovernorStats EdgeTpuClockGovernor::GetStats(uint64_t now_us) const {
+  EdgeTpuGovernorStats stats{};
+  stats.mode = mode_;
+  stats.transitions = transitions_;
+  stats.thermal_throttles = thermal_throttles_;
+  stats.temperature_c = temperature_c_;
+  for (int i = 0; i < kPerformanceModeCount; ++i) {
+    uint64_t us = time_in_mode_us_[i];
+    if (enabled_ && i == static_cast<int>(mode_)) us += now_us - mode_since_us_;
+    stats.time_in_mode_ms[i] = us / 1000;
+  }
+  return stats;
+}
+
+void EdgeTpuClockGovernor::AccountTime(uint64_t now_us) {
+  time_in_mode_us_[static_cast<int>(mode_)] += now_us - mode_since_us_;
+  mode_since_us_ = now_us;
+}
+
+}  // namespace coralmicro
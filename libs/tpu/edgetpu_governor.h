@@ -0,0 +1,117 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_GOVERNOR_H_
+#define LIBS_TPU_EDGETPU_GOVERNOR_H_
+
+#include <array>
+#include <cstdint>
+
+#include "libs/tpu/edgetpu_driver.h"
+
+namespace coralmicro {
+
+// Settings for the Edge TPU clock governor.
+struct EdgeTpuGovernorConfig {
+  // Slowest and fastest modes the governor may pick.
+  PerformanceMode min_mode = PerformanceMode::kLow;
+  PerformanceMode max_mode = PerformanceMode::kMax;
+  // Length of the window over which Edge TPU utilization is measured.
+  uint32_t window_ms = 500;
+  // Utilization (0 to 1) above which clocks are raised, and below which they
+  // are lowered. Clocks are also raised whenever invokes are queued.
+  float raise_utilization = 0.75f;
+  float lower_utilization = 0.25f;
+  // Shortest time between two mode changes. Each change resets the chip and
+  // drops cached parameters, so this bounds that overhead.
+  uint32_t min_dwell_ms = 2000;
+  // Junction temperature at which clocks are stepped down, and how far it
+  // must fall before they may be raised again.
+  float throttle_temperature_c = 85.0f;
+  float hysteresis_c = 5.0f;
+  // Junction temperature at which the slowest mode is forced.
+  float critical_temperature_c = 100.0f;
+  // How often the temperature is read.
+  uint32_t temperature_poll_ms = 250;
+};
+
+// Counters describing the governor's decisions.
+struct EdgeTpuGovernorStats {
+  PerformanceMode mode;
+  // Number of mode changes.
+  uint32_t transitions;
+  // Number of times clocks were stepped down because of temperature.
+  uint32_t thermal_throttles;
+  // Last temperature read, in Celsius.
+  float temperature_c;
+  // Time spent in each mode, indexed by `PerformanceMode`.
+  std::array<uint64_t, kPerformanceModeCount> time_in_mode_ms;
+};
+
+// Picks the Edge TPU performance mode from load and temperature.
+//
+// Decisions are only made when an invoke starts, since changing clocks
+// resets the chip. Clocks go up one step when invokes are queued or the
+// Edge TPU was busy for most of the last window, and down one step when it
+// was mostly idle. Above the throttle temperature the fastest allowed mode
+// drops one step at a time until the temperature falls below the threshold
+// minus the hysteresis.
+class EdgeTpuClockGovernor {
+ public:
+  void Start(const EdgeTpuGovernorConfig& config, PerformanceMode mode,
+             uint64_t now_us);
+  void Stop(uint64_t now_us);
+  bool enabled() const { return enabled_; }
+
+  // Returns true if a new temperature reading is due.
+  bool TemperatureDue(uint64_t now_us) const;
+  void SetTemperature(float temperature_c, uint64_t now_us);
+
+  // Returns the mode to run the next invoke at.
+  PerformanceMode OnInvokeStart(PerformanceMode current, uint32_t backlog,
+                                uint64_t now_us);
+  void OnInvokeEnd(uint64_t now_us);
+  // Records that the Edge TPU now runs at `mode`.
+  void OnModeChanged(PerformanceMode mode, uint64_t now_us);
+
+  EdgeTpuGovernorStats GetStats(uint64_t now_us) const;
+
+ private:
+  void AccountTime(uint64_t now_us);
+
+  EdgeTpuGovernorConfig config_;
+  bool enabled_ = false;
+  PerformanceMode mode_ = PerformanceMode::kHigh;
+  // Fastest mode allowed by the thermal limit.
+  PerformanceMode thermal_cap_ = PerformanceMode::kMax;
+  uint64_t mode_since_us_ = 0;
+  uint64_t last_change_us_ = 0;
+  uint64_t last_temperature_us_ = 0;
+  bool temperature_valid_ = false;
+  float temperature_c_ = 0.0f;
+  bool throttled_ = false;
+  uint64_t window_start_us_ = 0;
+  uint64_t window_busy_us_ = 0;
+  uint64_t invoke_start_us_ = 0;
+  float utilization_ = 0.0f;
+  uint32_t transitions_ = 0;
+  uint32_t thermal_throttles_ = 0;
+  std::array<uint64_t, kPerformanceModeCount> time_in_mode_us_{};
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_GOVERNOR_H_
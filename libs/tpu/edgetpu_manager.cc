@@ -16,14 +16,19 @@
 
 #include "libs/tpu/edgetpu_manager.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 #include "libs/base/check.h"
 #include "libs/base/mutex.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_op.h"
 #include "libs/tpu/edgetpu_task.h"
 #include "third_party/flatbuffers/include/flatbuffers/flatbuffers.h"
 #include "third_party/flatbuffers/include/flatbuffers/flexbuffers.h"
 #include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
+#include "third_party/tflite-micro/tensorflow/lite/schema/schema_generated.h"
 
 namespace coralmicro {
 namespace {
@@ -31,6 +36,34 @@ constexpr char kKeyVersion[] = "1";
 constexpr char kKeyChipName[] = "2";
 constexpr char kKeyParamCache_DEPRECATED[] = "3";
 constexpr char kKeyExecutable[] = "4";
+
+// Whether every output of the model's Edge TPU operators is also an output of
+// its subgraph, so that no later operator reads it.
+bool EdgeTpuOutputsAreModelOutputs(const void* model_data) {
+  const tflite::Model* model = tflite::GetModel(model_data);
+  const auto* opcodes = model->operator_codes();
+  if (!opcodes || !model->subgraphs()) return false;
+  for (const tflite::SubGraph* subgraph : *model->subgraphs()) {
+    if (!subgraph->operators()) continue;
+    const auto* subgraph_outputs = subgraph->outputs();
+    for (const tflite::Operator* op : *subgraph->operators()) {
+      if (op->opcode_index() >= opcodes->size()) return false;
+      const auto* custom_code = opcodes->Get(op->opcode_index())->custom_code();
+      if (!custom_code || std::strcmp(custom_code->c_str(), kCustomOp) != 0) {
+        continue;
+      }
+      if (!op->outputs()) continue;
+      for (const int32_t output : *op->outputs()) {
+        if (!subgraph_outputs ||
+            std::find(subgraph_outputs->begin(), subgraph_outputs->end(),
+                      output) == subgraph_outputs->end()) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
 }  // namespace
 
 EdgeTpuContext::EdgeTpuContext() {
@@ -49,14 +82,21 @@ EdgeTpuManager::EdgeTpuManager() : mutex_(xSemaphoreCreateMutex()) {
 
 void EdgeTpuManager::NotifyConnected(
     usb_host_edgetpu_instance_t* usb_instance) {
-  usb_instance_ = usb_instance;
+  usb_transport_.set_instance(usb_instance);
 
   // The EdgeTPU has left the USB bus -- clean up state.
-  if (!usb_instance_) {
-    current_parameter_caching_token_ = 0;
+  if (!usb_instance) {
+    parameter_cache_.Clear();
   }
 }
 
+void EdgeTpuManager::SetTransport(EdgeTpuTransport* transport) {
+  MutexLock lock(mutex_);
+  transport_ = transport ? transport : &usb_transport_;
+  // Nothing is known to be cached behind the new transport.
+  parameter_cache_.Clear();
+}
+
 void EdgeTpuManager::NotifyError() { usb_error_ = true; }
 
 std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
@@ -68,7 +108,7 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
 
   context = std::make_shared<EdgeTpuContext>();
 
-  while (!usb_instance_) {
+  while (!transport_->Connected()) {
     if (usb_error_) {
       printf("%s: Error encountered while bringing up the tpu\r\n", __func__);
       usb_error_ = false;  // Reset error.
@@ -78,8 +118,8 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
     vTaskDelay(pdMS_TO_TICKS(100));
   }
 
-  // Got tpu usb instance, init the tpu driver.
-  if (!tpu_driver_.Initialize(usb_instance_, mode)) {
+  // Got a connected transport, init the tpu driver.
+  if (!tpu_driver_.Initialize(transport_, mode)) {
     return nullptr;
   }
 
@@ -99,15 +139,15 @@ EdgeTpuPackage* EdgeTpuManager::RegisterPackage(const char* package_content,
   auto flexbuffer_map =
       flexbuffers::GetRoot((const uint8_t*)package_ptr, length).AsMap();
   auto package_binary = flexbuffer_map[kKeyExecutable].AsString();
-  flatbuffers::Verifier package_verifier((const uint8_t*)package_binary.c_str(),
-                                         package_binary.length());
-  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
-    printf("Package verification failed.\r\n");
+  const auto* package_data =
+      reinterpret_cast<const uint8_t*>(package_binary.c_str());
+
+  if (!VerifyPackage(package_data, package_binary.length())) {
     return nullptr;
   }
 
   auto* package =
-      flatbuffers::GetRoot<platforms::darwinn::Package>(package_binary.c_str());
+      flatbuffers::GetRoot<platforms::darwinn::Package>(package_data);
   if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
     printf("No executables to register.\r\n");
     return nullptr;
@@ -116,28 +156,12 @@ EdgeTpuPackage* EdgeTpuManager::RegisterPackage(const char* package_content,
   auto* multi_executable =
       flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
           package->serialized_multi_executable()->data());
-  flatbuffers::Verifier multi_executable_verifier(
-      package->serialized_multi_executable()->data(),
-      flatbuffers::VectorLength(package->serialized_multi_executable()));
-  if (!multi_executable_verifier
-           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
-    printf("MultiExecutable verification failed.\r\n");
-    return nullptr;
-  }
 
   const platforms::darwinn::Executable* inference_exe = nullptr;
   const platforms::darwinn::Executable* parameter_caching_exe = nullptr;
 
   for (const auto* executable_serialized :
        *(multi_executable->serialized_executables())) {
-    flatbuffers::Verifier verifier(
-        (const uint8_t*)executable_serialized->c_str(),
-        executable_serialized->size());
-    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
-      printf("Executable verification failed.\r\n");
-      return nullptr;
-    }
-
     const auto* executable =
         flatbuffers::GetRoot<platforms::darwinn::Executable>(
             (const uint8_t*)executable_serialized->c_str());
@@ -163,31 +187,213 @@ EdgeTpuPackage* EdgeTpuManager::RegisterPackage(const char* package_content,
   return edgetpu_package;
 }
 
+bool EdgeTpuManager::VerifyPackage(const uint8_t* data, size_t length) {
+  flatbuffers::Verifier package_verifier(data, length);
+  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
+    printf("Package verification failed.\r\n");
+    return false;
+  }
+
+  auto* package = flatbuffers::GetRoot<platforms::darwinn::Package>(data);
+  if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
+    // Reported by the caller.
+    return true;
+  }
+
+  auto* multi_executable =
+      flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
+          package->serialized_multi_executable()->data());
+  flatbuffers::Verifier multi_executable_verifier(
+      package->serialized_multi_executable()->data(),
+      flatbuffers::VectorLength(package->serialized_multi_executable()));
+  if (!multi_executable_verifier
+           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
+    printf("MultiExecutable verification failed.\r\n");
+    return false;
+  }
+
+  for (const auto* executable_serialized :
+       *(multi_executable->serialized_executables())) {
+    flatbuffers::Verifier verifier(
+        (const uint8_t*)executable_serialized->c_str(),
+        executable_serialized->size());
+    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
+      printf("Executable verification failed.\r\n");
+      return false;
+    }
+  }
+  return true;
+}
+
 TfLiteStatus EdgeTpuManager::Invoke(EdgeTpuPackage* package,
                                     TfLiteContext* context, TfLiteNode* node) {
-  MutexLock lock(mutex_);
-  if (package->parameter_caching_exe()) {
-    auto token = package->parameter_caching_exe()->ParameterCachingToken();
-    if (token != current_parameter_caching_token_) {
-      cached_packages_.fill(nullptr);
-      package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-      current_parameter_caching_token_ = token;
-      cached_packages_[0] = package;
-    } else {
-      for (auto& cached_package : cached_packages_) {
-        if (cached_package == package) {
-          break;
-        } else if (cached_package == nullptr) {
-          package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-          cached_package = package;
-        }
+  const int priority = package->priority == kTaskPriority
+                           ? static_cast<int>(uxTaskPriorityGet(nullptr))
+                           : package->priority;
+  const auto* parameter_caching_exe = package->parameter_caching_exe();
+  scheduler_.Acquire(
+      priority, package->deadline_us,
+      parameter_caching_exe ? parameter_caching_exe->ParameterCachingToken()
+                            : 0);
+  TfLiteStatus status;
+  uint64_t resident_token;
+  {
+    MutexLock lock(mutex_);
+    status = InvokeLocked(package, context, node);
+    resident_token = parameter_cache_.resident_token();
+  }
+  scheduler_.Release(resident_token);
+  return status;
+}
+
+TfLiteStatus EdgeTpuManager::InvokeLocked(EdgeTpuPackage* package,
+                                          TfLiteContext* context,
+                                          TfLiteNode* node) {
+  if (governor_.enabled()) {
+    UpdateClocks();
+  }
+
+  EdgeTpuProfiler* profiler = nullptr;
+  if (profiling_enabled_) {
+    if (!package->profiler) {
+      package->profiler = std::make_unique<EdgeTpuProfiler>();
+    }
+    profiler = package->profiler.get();
+    profiler->Begin();
+  }
+
+  if (auto* parameter_caching_exe = package->parameter_caching_exe()) {
+    const auto token = parameter_caching_exe->ParameterCachingToken();
+    if (!parameter_cache_.Lookup(package, token)) {
+      parameter_cache_.Insert(package, token,
+                              parameter_caching_exe->ParameterBytes());
+      if (parameter_caching_exe->Invoke(tpu_driver_, context, node,
+                                        profiler) != kTfLiteOk) {
+        parameter_cache_.Remove(package);
+        return kTfLiteError;
       }
     }
   } else {
-    current_parameter_caching_token_ = 0;
+    // Stand-alone executables stream their parameters through the same
+    // on-chip memory.
+    parameter_cache_.Clear();
+  }
+
+  // Another model's tensors may share memory with this one's, so outputs it
+  // left unconverted can't be filled in after this invoke.
+  if (last_invoked_ && last_invoked_ != package) {
+    last_invoked_->inference_exe()->ClearOutputTargets();
+  }
+  last_invoked_ = package;
+  const TfLiteStatus status =
+      package->inference_exe()->Invoke(tpu_driver_, context, node, profiler);
+  if (profiler && status == kTfLiteOk) {
+    profiler->End();
+  }
+  if (governor_.enabled()) {
+    governor_.OnInvokeEnd(TimerMicros());
+  }
+  return status;
+}
+
+void EdgeTpuManager::UpdateClocks() {
+  const uint64_t now = TimerMicros();
+  if (governor_.TemperatureDue(now)) {
+    governor_.SetTemperature(tpu_driver_.GetTemperature(), now);
+  }
+  const auto current = tpu_driver_.performance_mode();
+  const auto mode = governor_.OnInvokeStart(
+      current, scheduler_.GetStats().queue_depth, now);
+  if (mode == current) return;
+
+  if (!tpu_driver_.SetPerformanceMode(mode)) {
+    printf("Failed to change Edge TPU performance mode\r\n");
+    return;
+  }
+  // The reset cleared the on-chip parameter cache.
+  parameter_cache_.Clear();
+  governor_.OnModeChanged(mode, TimerMicros());
+}
+
+EdgeTpuParameterCache::Stats EdgeTpuManager::GetParameterCacheStats() {
+  MutexLock lock(mutex_);
+  return parameter_cache_.stats();
+}
+
+bool EdgeTpuManager::SetInvokePriority(const void* model_data,
+                                       size_t model_size, int priority,
+                                       uint32_t deadline_us) {
+  MutexLock lock(mutex_);
+  return ForEachPackage(model_data, model_size, [&](EdgeTpuPackage* package) {
+    package->priority = priority;
+    package->deadline_us = deadline_us;
+  });
+}
+
+bool EdgeTpuManager::SetLazyOutputs(const void* model_data, size_t model_size,
+                                    bool lazy) {
+  if (lazy && !EdgeTpuOutputsAreModelOutputs(model_data)) {
+    printf("Lazy outputs need every Edge TPU output to be a model output\r\n");
+    return false;
+  }
+  MutexLock lock(mutex_);
+  return ForEachPackage(model_data, model_size, [&](EdgeTpuPackage* package) {
+    package->inference_exe()->set_lazy_outputs(lazy);
+  });
+}
+
+bool EdgeTpuManager::RelayoutOutput(const void* tensor_data) {
+  MutexLock lock(mutex_);
+  for (const auto& entry : packages_) {
+    if (entry.second->inference_exe()->RelayoutOutput(tensor_data)) {
+      return true;
+    }
   }
+  return false;
+}
+
+EdgeTpuScheduler::Stats EdgeTpuManager::GetSchedulerStats() {
+  return scheduler_.GetStats();
+}
 
-  return package->inference_exe()->Invoke(tpu_driver_, context, node);
+void EdgeTpuManager::SetProfilingEnabled(bool enabled) {
+  MutexLock lock(mutex_);
+  profiling_enabled_ = enabled;
+}
+
+std::vector<EdgeTpuProfile> EdgeTpuManager::GetProfiles() {
+  MutexLock lock(mutex_);
+  std::vector<EdgeTpuProfile> profiles;
+  for (const auto& entry : packages_) {
+    EdgeTpuPackage* package = entry.second;
+    if (package->profiler) {
+      profiles.push_back(
+          package->profiler->GetProfile(package->inference_exe()->name()));
+    }
+  }
+  return profiles;
+}
+
+void EdgeTpuManager::ResetProfiles() {
+  MutexLock lock(mutex_);
+  for (const auto& entry : packages_) {
+    if (entry.second->profiler) entry.second->profiler->Reset();
+  }
+}
+
+void EdgeTpuManager::EnableClockGovernor(const EdgeTpuGovernorConfig& config) {
+  MutexLock lock(mutex_);
+  governor_.Start(config, tpu_driver_.performance_mode(), TimerMicros());
+}
+
+void EdgeTpuManager::DisableClockGovernor() {
+  MutexLock lock(mutex_);
+  governor_.Stop(TimerMicros());
+}
+
+EdgeTpuGovernorStats EdgeTpuManager::GetClockGovernorStats() {
+  MutexLock lock(mutex_);
+  return governor_.GetStats(TimerMicros());
 }
 
 std::optional<float> EdgeTpuManager::GetTemperature() {
@@ -198,4 +404,9 @@ std::optional<float> EdgeTpuManager::GetTemperature() {
   return std::nullopt;
 }
 
+uint32_t EdgeTpuManager::GetBringUpTime() {
+  MutexLock lock(mutex_);
+  return tpu_driver_.bring_up_us();
+}
+
 }  // namespace coralmicro
@@ -21,9 +21,16 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
 
 #include "libs/tpu/edgetpu_driver.h"
 #include "libs/tpu/edgetpu_executable.h"
+#include "libs/tpu/edgetpu_governor.h"
+#include "libs/tpu/edgetpu_parameter_cache.h"
+#include "libs/tpu/edgetpu_profiler.h"
+#include "libs/tpu/edgetpu_scheduler.h"
+#include "libs/tpu/edgetpu_transport.h"
+#include "libs/tpu/edgetpu_usb_transport.h"
 #include "libs/tpu/executable_generated.h"
 #include "libs/tpu/usb_host_edgetpu.h"
 #include "third_party/freertos_kernel/include/FreeRTOS.h"
@@ -68,6 +75,14 @@ class EdgeTpuPackage {
   }
   EdgeTpuExecutable* inference_exe() { return inference_.get(); }
 
+  // Scheduling class of this package's invokes, or
+  // `EdgeTpuManager::kTaskPriority` to use the invoking task's priority.
+  int priority = -1;
+  // Time allowed for an invoke from the moment it is requested, or 0.
+  uint32_t deadline_us = 0;
+  // Created the first time this package is invoked with profiling enabled.
+  std::unique_ptr<EdgeTpuProfiler> profiler;
+
  private:
   std::unique_ptr<EdgeTpuExecutable> inference_;
   std::unique_ptr<EdgeTpuExecutable> parameter_caching_;
@@ -77,6 +92,10 @@ class EdgeTpuPackage {
 // Singleton Edge TPU manager for allocating new instances of `EdgeTpuContext`.
 class EdgeTpuManager {
  public:
+  // Priority that schedules a model's invokes at the FreeRTOS priority of the
+  // task calling the interpreter. This is the default.
+  static constexpr int kTaskPriority = -1;
+
   // @cond Do not generate docs
   EdgeTpuManager();
   EdgeTpuManager(const EdgeTpuManager&) = delete;
@@ -122,20 +141,141 @@ class EdgeTpuManager {
   void NotifyConnected(usb_host_edgetpu_instance_t* usb_instance);
   // @endcond
 
+  // Routes Edge TPU traffic through `transport` instead of USB, e.g. an
+  // `EdgeTpuRecordingTransport` wrapping `usb_transport()` to capture a
+  // trace, or an `EdgeTpuReplayTransport` to run without a device. Takes
+  // effect at the next `OpenDevice()`, so call it while no `EdgeTpuContext`
+  // is held.
+  //
+  // @param transport The transport to use, or nullptr to go back to USB. It
+  // must stay alive until it's replaced.
+  void SetTransport(EdgeTpuTransport* transport);
+
+  // Gets the USB transport, for wrapping in another transport.
+  EdgeTpuTransport* usb_transport() { return &usb_transport_; }
+
+  // Gets the parameter cache hit, miss, eviction and upload byte counters.
+  EdgeTpuParameterCache::Stats GetParameterCacheStats();
+
+  // Sets how a model's invokes are scheduled when several interpreters use
+  // the Edge TPU at once. Waiting invokes run in order of priority, then
+  // deadline, then whether their parameters are already cached. A running
+  // invoke is never interrupted.
+  //
+  // @param model_data The model flatbuffer given to the interpreter. The
+  // interpreter must have allocated its tensors already.
+  // @param model_size The size of `model_data`, in bytes.
+  // @param priority Higher values run first. Use `kTaskPriority` to follow the
+  // FreeRTOS priority of the invoking task.
+  // @param deadline_us Time allowed for each invoke, including time spent
+  // waiting for others, in microseconds; 0 for none. Invokes with deadlines
+  // run before those without one at the same priority.
+  // @return True if the model has Edge TPU operators, false otherwise.
+  bool SetInvokePriority(const void* model_data, size_t model_size,
+                         int priority, uint32_t deadline_us = 0);
+
+  // Leaves a model's Edge TPU outputs in the device layout after each invoke,
+  // so that only the outputs that are actually read pay for being converted
+  // to tensor order. Each output must then be requested with
+  // `RelayoutOutput()` before its tensor is read, and before any other model
+  // is invoked. This is only allowed if every Edge TPU output is a model
+  // output, as other operators in the model would read stale data.
+  //
+  // @param model_data The model flatbuffer given to the interpreter. The
+  // interpreter must have allocated its tensors already.
+  // @param model_size The size of `model_data`, in bytes.
+  // @param lazy True to relay out outputs on request, false to relay out
+  // every output during the invoke (the default).
+  // @return True if the model has Edge TPU operators and `lazy` is allowed
+  // for it, false otherwise.
+  bool SetLazyOutputs(const void* model_data, size_t model_size, bool lazy);
+
+  // Fills an Edge TPU output tensor from the last invoke of its model, if it
+  // isn't already. This is cheap for outputs that are up to date, so it can
+  // be called before every read. For example:
+  //
+  // ```
+  // auto* scores = interpreter.output_tensor(1);
+  // EdgeTpuManager::GetSingleton()->RelayoutOutput(scores->data.data);
+  // ```
+  //
+  // @param tensor_data The data pointer of the output tensor.
+  // @return True if `tensor_data` is an output of the last Edge TPU invoke,
+  // false otherwise.
+  bool RelayoutOutput(const void* tensor_data);
+
+  // Gets queue depth, wait time and deadline statistics for Edge TPU invokes.
+  EdgeTpuScheduler::Stats GetSchedulerStats();
+
+  // Enables or disables recording of per-phase invoke timings. Profiling is
+  // disabled by default; recorded data is kept when it is disabled.
+  void SetProfilingEnabled(bool enabled);
+
+  // Gets the recorded invoke profile of every model invoked while profiling
+  // was enabled.
+  std::vector<EdgeTpuProfile> GetProfiles();
+
+  // Clears all recorded invoke profiles.
+  void ResetProfiles();
+
+  // Starts adjusting the Edge TPU clocks to load and temperature, overriding
+  // the `PerformanceMode` given to `OpenDevice()`. See `EdgeTpuGovernorConfig`
+  // for the policy. Each change resets the Edge TPU between two invokes and
+  // drops cached parameters, so it costs roughly one parameter upload.
+  //
+  // @param config The governor settings.
+  void EnableClockGovernor(const EdgeTpuGovernorConfig& config = {});
+
+  // Stops adjusting the Edge TPU clocks, leaving them at the current mode.
+  void DisableClockGovernor();
+
+  // Gets the governor's current mode, transition counts, last temperature
+  // and time spent in each mode.
+  EdgeTpuGovernorStats GetClockGovernorStats();
+
   // Gets the current Edge TPU junction temperature.
   // @returns The temperature in Celcius, or `std::nullopt` if
   // `EdgeTpuContext` is empty.
   std::optional<float> GetTemperature();
 
+  // Gets how long the last Edge TPU bring-up took, from `OpenDevice()` or a
+  // clock governor mode change.
+  // @returns The time in microseconds, or 0 if the device hasn't been opened.
+  uint32_t GetBringUpTime();
+
  private:
+  TfLiteStatus InvokeLocked(EdgeTpuPackage* package, TfLiteContext* context,
+                            TfLiteNode* node);
+  void UpdateClocks();
+  // Runs the flatbuffer verifier over a package and its executables.
+  bool VerifyPackage(const uint8_t* data, size_t length);
+  // Calls `fn` for each package whose custom op options lie in the model.
+  template <typename Fn>
+  bool ForEachPackage(const void* model_data, size_t model_size, Fn fn) {
+    const auto begin = reinterpret_cast<uintptr_t>(model_data);
+    const auto end = begin + model_size;
+    bool found = false;
+    for (auto it = packages_.lower_bound(begin);
+         it != packages_.end() && it->first < end; ++it) {
+      fn(it->second);
+      found = true;
+    }
+    return found;
+  }
+
   TpuDriver tpu_driver_;
   std::map<uintptr_t, EdgeTpuPackage*> packages_;
-  std::array<EdgeTpuPackage*, 2> cached_packages_;
-  uint64_t current_parameter_caching_token_ = 0;
-  usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  EdgeTpuParameterCache parameter_cache_;
+  EdgeTpuScheduler scheduler_;
+  EdgeTpuClockGovernor governor_;
+  EdgeTpuUsbTransport usb_transport_;
+  EdgeTpuTransport* transport_ = &usb_transport_;
   std::weak_ptr<EdgeTpuContext> context_;
   SemaphoreHandle_t mutex_;
   bool usb_error_{false};
+  bool profiling_enabled_{false};
+  // The package invoked last, whose lazy outputs are still available.
+  EdgeTpuPackage* last_invoked_{nullptr};
 };
 
 }  // namespace coralmicro
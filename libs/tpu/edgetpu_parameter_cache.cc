@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_parameter_cache.h"
+
+namespace coralmicro {
+
+bool EdgeTpuParameterCache::Lookup(const void* model, uint64_t token) {
+  if (token != resident_token_ || resident_.count(model) == 0) {
+    return false;
+  }
+  ++stats_.hits;
+  return true;
+}
+
+void EdgeTpuParameterCache::Insert(const void* model, uint64_t token,
+                                   size_t size_bytes) {
+  if (token != resident_token_) {
+    stats_.evictions += resident_.size();
+    resident_.clear();
+    resident_token_ = token;
+  }
+  resident_.insert(model);
+  ++stats_.misses;
+  stats_.upload_bytes += size_bytes;
+}
+
+void EdgeTpuParameterCache::Remove(const void* model) {
+  resident_.erase(model);
+}
+
+void EdgeTpuParameterCache::Clear() {
+  resident_.clear();
+  resident_token_ = 0;
+}
+
+}  // namespace coralmicro
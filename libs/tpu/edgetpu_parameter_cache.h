@@ -0,0 +1,77 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
+#define LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+
+namespace coralmicro {
+
+// Tracks which models have their parameters cached in Edge TPU SRAM.
+//
+// Models that were co-compiled share a parameter caching token. The compiler
+// lays their parameters out side by side in on-chip memory, so once uploaded
+// they all stay resident, however many there are. Models with different
+// tokens use overlapping on-chip addresses, so the only eviction is a switch
+// to another token, which drops every resident model. Co-compile models that
+// run in alternation to avoid re-uploading them.
+//
+// This class is not thread-safe; `EdgeTpuManager` serializes access to it.
+class EdgeTpuParameterCache {
+ public:
+  // Counters describing how well the cache is doing.
+  struct Stats {
+    // Invokes that found their parameters already on chip.
+    uint32_t hits;
+    // Invokes that had to upload their parameters first.
+    uint32_t misses;
+    // Models dropped from the chip by a switch to another token.
+    uint32_t evictions;
+    // Total parameter bytes uploaded.
+    uint64_t upload_bytes;
+  };
+
+  // Returns true if the parameters of `model` are on chip under `token`.
+  bool Lookup(const void* model, uint64_t token);
+
+  // Records that `size_bytes` of parameters for `model` are about to be
+  // uploaded under `token`, dropping the models of any other token.
+  void Insert(const void* model, uint64_t token, size_t size_bytes);
+
+  // Forgets that `model` is on chip, e.g. after a failed upload.
+  void Remove(const void* model);
+
+  // Forgets every model, e.g. when the Edge TPU loses its SRAM contents.
+  void Clear();
+
+  // Token of the models currently on chip, or 0 if there are none.
+  uint64_t resident_token() const { return resident_token_; }
+
+  const Stats& stats() const { return stats_; }
+  void ResetStats() { stats_ = {}; }
+
+ private:
+  std::set<const void*> resident_;
+  uint64_t resident_token_ = 0;
+  Stats stats_{};
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
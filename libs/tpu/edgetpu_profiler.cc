@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_profiler.h"
+
+#include <algorithm>
+
+namespace coralmicro {
+
+const char* EdgeTpuPhaseName(EdgeTpuPhase phase) {
+  switch (phase) {
+    case EdgeTpuPhase::kInstructions:
+      return "instructions";
+    case EdgeTpuPhase::kParameters:
+      return "parameters";
+    case EdgeTpuPhase::kInputs:
+      return "inputs";
+    case EdgeTpuPhase::kOutputs:
+      return "outputs";
+    case EdgeTpuPhase::kWaitEvent:
+      return "wait_event";
+    case EdgeTpuPhase::kRelayout:
+      return "relayout";
+  }
+  return "unknown";
+}
+
+void EdgeTpuProfiler::Begin() { current_us_.fill(0); }
+
+void EdgeTpuProfiler::Record(EdgeTpuPhase phase, uint32_t us,
+                             uint32_t bytes) {
+  const int i = static_cast<int>(phase);
+  current_us_[i] += us;
+  bytes_[i] += bytes;
+}
+
+void EdgeTpuProfiler::End() {
+  const int slot = invokes_ % kWindowSize;
+  for (int i = 0; i < kEdgeTpuPhaseCount; ++i) {
+    samples_us_[i][slot] = current_us_[i];
+  }
+  ++invokes_;
+}
+
+void EdgeTpuProfiler::Reset() {
+  bytes_.fill(0);
+  invokes_ = 0;
+}
+
+EdgeTpuProfile EdgeTpuProfiler::GetProfile(const char* name) const {
+  EdgeTpuProfile profile{};
+  profile.name = name;
+  profile.invokes = invokes_;
+  const int count = std::min<uint32_t>(invokes_, kWindowSize);
+  for (int i = 0; i < kEdgeTpuPhaseCount; ++i) {
+    auto& stats = profile.phases[i];
+    stats.bytes = bytes_[i];
+    if (count == 0) continue;
+
+    std::array<uint32_t, kWindowSize> sorted = samples_us_[i];
+    std::sort(sorted.begin(), sorted.begin() + count);
+    uint64_t sum = 0;
+    for (int j = 0; j < count; ++j) sum += sorted[j];
+    stats.min_us = sorted[0];
+    stats.avg_us = sum / count;
+    // Nearest-rank percentile.
+    stats.p99_us = sorted[(count * 99 + 99) / 100 - 1];
+  }
+  return profile;
+}
+
+}  // namespace coralmicro
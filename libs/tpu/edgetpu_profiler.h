@@ -0,0 +1,89 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PROFILER_H_
+#define LIBS_TPU_EDGETPU_PROFILER_H_
+
+#include <array>
+#include <cstdint>
+
+namespace coralmicro {
+
+// The phases of an Edge TPU invoke.
+enum class EdgeTpuPhase {
+  // Sending instruction bitstreams.
+  kInstructions,
+  // Sending parameters, including parameter caching invokes.
+  kParameters,
+  // Sending inputs, including the sign conversion of signed inputs.
+  kInputs,
+  // Reading outputs back from the Edge TPU.
+  kOutputs,
+  // Waiting for the Edge TPU to report completion.
+  kWaitEvent,
+  // Reordering outputs into tensors, including sign conversion.
+  kRelayout,
+};
+inline constexpr int kEdgeTpuPhaseCount = 6;
+
+// Gets a short name for `phase`, e.g. "instructions".
+const char* EdgeTpuPhaseName(EdgeTpuPhase phase);
+
+// Timing and traffic of one phase over the recent invokes.
+struct EdgeTpuPhaseStats {
+  uint32_t min_us;
+  uint32_t avg_us;
+  uint32_t p99_us;
+  // Bytes moved by this phase over all recorded invokes.
+  uint64_t bytes;
+};
+
+// Rolling per-phase statistics of a model's Edge TPU invokes.
+struct EdgeTpuProfile {
+  // Name of the model's executable, if the compiler recorded one.
+  const char* name;
+  // Invokes recorded since profiling was enabled or reset.
+  uint32_t invokes;
+  std::array<EdgeTpuPhaseStats, kEdgeTpuPhaseCount> phases;
+};
+
+// Records how long each phase of an invoke takes, keeping the last
+// `kWindowSize` invokes for the min/avg/p99 summaries.
+class EdgeTpuProfiler {
+ public:
+  static constexpr int kWindowSize = 64;
+
+  // Starts recording a new invoke.
+  void Begin();
+  // Adds `us` and `bytes` to `phase` of the current invoke.
+  void Record(EdgeTpuPhase phase, uint32_t us, uint32_t bytes);
+  // Finishes the current invoke and adds it to the window.
+  void End();
+
+  void Reset();
+  EdgeTpuProfile GetProfile(const char* name) const;
+
+ private:
+  std::array<std::array<uint32_t, kWindowSize>, kEdgeTpuPhaseCount>
+      samples_us_{};
+  std::array<uint32_t, kEdgeTpuPhaseCount> current_us_{};
+  std::array<uint64_t, kEdgeTpuPhaseCount> bytes_{};
+  uint32_t invokes_ = 0;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PROFILER_H_
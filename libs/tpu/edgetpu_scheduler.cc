@@ -0,0 +1,121 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_scheduler.h"
+
+#include <algorithm>
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
+
+namespace coralmicro {
+namespace {
+// Notification index used to wake a waiting task. Index 0 is left to
+// applications, and index 1 is otherwise only used by the IPC transmit task.
+constexpr UBaseType_t kGrantNotification = 1;
+}  // namespace
+
+EdgeTpuScheduler::EdgeTpuScheduler() : mutex_(xSemaphoreCreateMutex()) {
+  CHECK(mutex_);
+}
+
+bool EdgeTpuScheduler::Precedes(const Request& a, const Request& b,
+                                uint64_t resident_token) {
+  if (a.priority != b.priority) return a.priority > b.priority;
+  if (a.deadline != b.deadline) {
+    // Requests without a deadline go last.
+    if (!a.deadline || !b.deadline) return a.deadline != 0;
+    return a.deadline < b.deadline;
+  }
+  const bool a_cached = a.token == resident_token;
+  const bool b_cached = b.token == resident_token;
+  if (a_cached != b_cached) return a_cached;
+  return static_cast<int32_t>(a.sequence - b.sequence) < 0;
+}
+
+void EdgeTpuScheduler::Grant(const Request& request, uint64_t now) {
+  busy_ = true;
+  active_deadline_ = request.deadline;
+  ++stats_.invokes;
+  const uint64_t wait_us = now - request.enqueue_time;
+  stats_.total_wait_us += wait_us;
+  stats_.max_wait_us =
+      std::max<uint32_t>(stats_.max_wait_us, static_cast<uint32_t>(wait_us));
+}
+
+void EdgeTpuScheduler::Acquire(int priority, uint32_t deadline_us,
+                               uint64_t token) {
+  const uint64_t now = TimerMicros();
+  Request request{};
+  request.task = xTaskGetCurrentTaskHandle();
+  request.priority = priority;
+  request.deadline = deadline_us ? now + deadline_us : 0;
+  request.token = token;
+  request.enqueue_time = now;
+  {
+    MutexLock lock(mutex_);
+    if (!busy_) {
+      Grant(request, now);
+      return;
+    }
+    request.sequence = sequence_++;
+    request.next = waiting_;
+    waiting_ = &request;
+    ++stats_.contended_invokes;
+    stats_.max_queue_depth =
+        std::max(stats_.max_queue_depth, ++stats_.queue_depth);
+  }
+  ulTaskNotifyTakeIndexed(kGrantNotification, pdTRUE, portMAX_DELAY);
+}
+
+void EdgeTpuScheduler::Release(uint64_t resident_token) {
+  MutexLock lock(mutex_);
+  const uint64_t now = TimerMicros();
+  if (active_deadline_ && now > active_deadline_) {
+    ++stats_.deadline_misses;
+  }
+
+  Request** best = nullptr;
+  for (Request** it = &waiting_; *it; it = &(*it)->next) {
+    if (!best || Precedes(**it, **best, resident_token)) best = it;
+  }
+  if (!best) {
+    busy_ = false;
+    active_deadline_ = 0;
+    return;
+  }
+
+  Request* next = *best;
+  *best = next->next;
+  --stats_.queue_depth;
+  Grant(*next, now);
+  xTaskNotifyGiveIndexed(next->task, kGrantNotification);
+}
+
+EdgeTpuScheduler::Stats EdgeTpuScheduler::GetStats() {
+  MutexLock lock(mutex_);
+  return stats_;
+}
+
+void EdgeTpuScheduler::ResetStats() {
+  MutexLock lock(mutex_);
+  const uint32_t queue_depth = stats_.queue_depth;
+  stats_ = {};
+  stats_.queue_depth = queue_depth;
+}
+
+}  // namespace coralmicro
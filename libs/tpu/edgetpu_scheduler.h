@@ -0,0 +1,101 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_SCHEDULER_H_
+#define LIBS_TPU_EDGETPU_SCHEDULER_H_
+
+#include <cstdint>
+
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+namespace coralmicro {
+
+// Decides which task gets the Edge TPU next when several interpreters invoke
+// at once.
+//
+// Waiting requests are served by priority class first, then earliest
+// deadline, then by whether their parameters are already cached on chip, and
+// finally in arrival order. An invoke that is already running is never
+// preempted, so a high priority request waits for at most one invoke.
+class EdgeTpuScheduler {
+ public:
+  // Counters describing contention for the Edge TPU.
+  struct Stats {
+    // Invokes that have been granted the Edge TPU.
+    uint32_t invokes;
+    // Invokes that had to wait for another one to finish.
+    uint32_t contended_invokes;
+    // Invokes that finished after their deadline.
+    uint32_t deadline_misses;
+    // Requests currently waiting.
+    uint32_t queue_depth;
+    // Most requests ever waiting at once.
+    uint32_t max_queue_depth;
+    // Total and longest time spent waiting for the Edge TPU.
+    uint64_t total_wait_us;
+    uint32_t max_wait_us;
+  };
+
+  EdgeTpuScheduler();
+  EdgeTpuScheduler(const EdgeTpuScheduler&) = delete;
+  EdgeTpuScheduler& operator=(const EdgeTpuScheduler&) = delete;
+
+  // Blocks the calling task until it may use the Edge TPU.
+  //
+  // @param priority The request's class; higher values are served first.
+  // @param deadline_us Time after `Acquire()` by which the invoke should be
+  //   done, or 0 for none.
+  // @param token The parameter caching token the invoke needs, or 0.
+  void Acquire(int priority, uint32_t deadline_us, uint64_t token);
+
+  // Hands the Edge TPU to the next waiting request.
+  //
+  // @param resident_token The parameter caching token now cached on chip.
+  void Release(uint64_t resident_token);
+
+  Stats GetStats();
+  void ResetStats();
+
+ private:
+  // Lives on the stack of the task waiting in `Acquire()`.
+  struct Request {
+    TaskHandle_t task;
+    int priority;
+    uint64_t deadline;
+    uint64_t token;
+    uint64_t enqueue_time;
+    uint32_t sequence;
+    Request* next;
+  };
+
+  // Returns true if `a` should be served before `b`.
+  static bool Precedes(const Request& a, const Request& b,
+                       uint64_t resident_token);
+  void Grant(const Request& request, uint64_t now);
+
+  SemaphoreHandle_t mutex_;
+  Request* waiting_ = nullptr;
+  bool busy_ = false;
+  uint64_t active_deadline_ = 0;
+  uint32_t sequence_ = 0;
+  Stats stats_{};
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_SCHEDULER_H_
@@ -0,0 +1,344 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace coralmicro {
+namespace {
+bool IsRead(EdgeTpuTraceOp op) {
+  return op == EdgeTpuTraceOp::kControlRead || op == EdgeTpuTraceOp::kBulkIn ||
+         op == EdgeTpuTraceOp::kEvent;
+}
+
+size_t PayloadSize(EdgeTpuTraceOp op, uint32_t length) {
+  return IsRead(op) ? (length + 3) & ~3u : 0;
+}
+
+uint32_t ControlAddress(const EdgeTpuControlRequest& request) {
+  return static_cast<uint32_t>(request.index) << 16 | request.value;
+}
+
+void Complete(EdgeTpuTransfer* transfer, uint32_t transferred, bool ok) {
+  transfer->transferred = transferred;
+  transfer->ok = ok;
+  transfer->done(transfer);
+}
+}  // namespace
+
+uint32_t EdgeTpuTraceChecksum(const uint8_t* data, uint32_t length) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < length; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+EdgeTpuRecordingTransport::EdgeTpuRecordingTransport(
+    EdgeTpuTransport* transport, uint8_t* buffer, size_t capacity)
+    : transport_(transport) {
+  // Records are written in place, so start them on a word boundary.
+  const size_t skip = -reinterpret_cast<uintptr_t>(buffer) & 3;
+  buffer_ = buffer + std::min(skip, capacity);
+  capacity_ = capacity - std::min(skip, capacity);
+  Reset();
+}
+
+void EdgeTpuRecordingTransport::Reset() {
+  used_ = 0;
+  overflowed_ = false;
+  const EdgeTpuTraceHeader header = {kEdgeTpuTraceMagic, kEdgeTpuTraceVersion};
+  if (capacity_ < sizeof(header)) {
+    overflowed_ = true;
+    return;
+  }
+  memcpy(buffer_, &header, sizeof(header));
+  used_ = sizeof(header);
+}
+
+EdgeTpuRecordingTransport::Pending* EdgeTpuRecordingTransport::Begin(
+    EdgeTpuTraceOp op, EdgeTpuTransfer* transfer) {
+  if (overflowed_) return nullptr;
+  Pending* pending = &pending_[next_pending_];
+  const size_t size =
+      sizeof(EdgeTpuTraceRecord) + PayloadSize(op, transfer->length);
+  if (pending->in_use || capacity_ - used_ < size) {
+    // A gap would make the rest of the trace unusable.
+    overflowed_ = true;
+    return nullptr;
+  }
+  next_pending_ = (next_pending_ + 1) % kMaxPending;
+
+  auto* record = reinterpret_cast<EdgeTpuTraceRecord*>(buffer_ + used_);
+  memset(record, 0, size);
+  record->op = op;
+  record->length = transfer->length;
+  if (!IsRead(op)) {
+    record->checksum = EdgeTpuTraceChecksum(transfer->data, transfer->length);
+  }
+
+  pending->self = this;
+  pending->transfer = transfer;
+  pending->record = record;
+  pending->data = transfer->data;
+  pending->length = transfer->length;
+  pending->transferred = 0;
+  pending->ok = false;
+  pending->done = Done;
+  pending->in_use = true;
+  return pending;
+}
+
+template <typename Submit>
+bool EdgeTpuRecordingTransport::Forward(EdgeTpuTraceOp op,
+                                        EdgeTpuTransfer* transfer,
+                                        Submit submit) {
+  Pending* pending = Begin(op, transfer);
+  if (!pending) return submit(transfer);
+
+  // The record is committed before submitting, since the transfer may
+  // complete before `submit` returns.
+  const size_t used = used_;
+  used_ += sizeof(EdgeTpuTraceRecord) + PayloadSize(op, transfer->length);
+  if (!submit(pending)) {
+    used_ = used;
+    pending->in_use = false;
+    return false;
+  }
+  return true;
+}
+
+void EdgeTpuRecordingTransport::Done(EdgeTpuTransfer* transfer) {
+  auto* pending = static_cast<Pending*>(transfer);
+  EdgeTpuTraceRecord* record = pending->record;
+  const uint32_t transferred = pending->transferred;
+  record->ok = pending->ok;
+  record->transferred = transferred;
+  if (IsRead(record->op)) {
+    memcpy(record + 1, pending->data, std::min(transferred, record->length));
+  }
+
+  EdgeTpuTransfer* caller = pending->transfer;
+  caller->transferred = transferred;
+  caller->ok = pending->ok;
+  pending->in_use = false;
+  caller->done(caller);
+}
+
+bool EdgeTpuRecordingTransport::Control(const EdgeTpuControlRequest& request,
+                                        EdgeTpuTransfer* transfer) {
+  const auto op = request.read ? EdgeTpuTraceOp::kControlRead
+                               : EdgeTpuTraceOp::kControlWrite;
+  return Forward(op, transfer, [&](EdgeTpuTransfer* t) {
+    // `t` is the caller's own transfer if this one isn't being recorded.
+    if (t != transfer) {
+      auto* record = static_cast<Pending*>(t)->record;
+      record->request = request.request;
+      record->address = ControlAddress(request);
+    }
+    return transport_->Control(request, t);
+  });
+}
+
+bool EdgeTpuRecordingTransport::BulkOut(EdgeTpuTransfer* transfer) {
+  return Forward(EdgeTpuTraceOp::kBulkOut, transfer,
+                 [this](EdgeTpuTransfer* t) { return transport_->BulkOut(t); });
+}
+
+bool EdgeTpuRecordingTransport::BulkIn(EdgeTpuTransfer* transfer) {
+  return Forward(EdgeTpuTraceOp::kBulkIn, transfer,
+                 [this](EdgeTpuTransfer* t) { return transport_->BulkIn(t); });
+}
+
+bool EdgeTpuRecordingTransport::ReadEvent(EdgeTpuTransfer* transfer) {
+  return Forward(
+      EdgeTpuTraceOp::kEvent, transfer,
+      [this](EdgeTpuTransfer* t) { return transport_->ReadEvent(t); });
+}
+
+EdgeTpuReplayTransport::EdgeTpuReplayTransport(const uint8_t* trace,
+                                               size_t size)
+    : trace_(trace), size_(size) {
+  EdgeTpuTraceHeader header;
+  if (size < sizeof(header)) return;
+  memcpy(&header, trace, sizeof(header));
+  if (header.magic != kEdgeTpuTraceMagic ||
+      header.version != kEdgeTpuTraceVersion) {
+    return;
+  }
+  size_t offset = sizeof(header);
+  while (offset < size) {
+    EdgeTpuTraceRecord record;
+    if (size - offset < sizeof(record)) return;
+    memcpy(&record, trace + offset, sizeof(record));
+    if (record.transferred > record.length) return;
+    offset += sizeof(record) + PayloadSize(record.op, record.length);
+  }
+  valid_ = offset == size;
+  Rewind();
+}
+
+void EdgeTpuReplayTransport::Rewind() {
+  mismatches_ = 0;
+  for (int channel = 0; channel < kChannelCount; ++channel) {
+    Cursor& cursor = cursors_[channel];
+    cursor.offset = valid_ ? sizeof(EdgeTpuTraceHeader) : size_;
+    cursor.consumed = 0;
+    EdgeTpuTraceRecord record;
+    if (Current(cursor, &record) &&
+        ChannelOf(record.op) != static_cast<Channel>(channel)) {
+      Advance(static_cast<Channel>(channel), &cursor);
+    }
+  }
+}
+
+bool EdgeTpuReplayTransport::done() const {
+  EdgeTpuTraceRecord record;
+  for (const Cursor& cursor : cursors_) {
+    if (Current(cursor, &record)) return false;
+  }
+  return true;
+}
+
+EdgeTpuReplayTransport::Channel EdgeTpuReplayTransport::ChannelOf(
+    EdgeTpuTraceOp op) {
+  switch (op) {
+    case EdgeTpuTraceOp::kControlRead:
+    case EdgeTpuTraceOp::kControlWrite:
+      return kControl;
+    case EdgeTpuTraceOp::kBulkOut:
+      return kBulkOut;
+    case EdgeTpuTraceOp::kBulkIn:
+      return kBulkIn;
+    case EdgeTpuTraceOp::kEvent:
+      return kEvent;
+  }
+  return kChannelCount;
+}
+
+bool EdgeTpuReplayTransport::Current(const Cursor& cursor,
+                                     EdgeTpuTraceRecord* record) const {
+  if (cursor.offset >= size_) return false;
+  memcpy(record, trace_ + cursor.offset, sizeof(*record));
+  return true;
+}
+
+const uint8_t* EdgeTpuReplayTransport::Payload(const Cursor& cursor) const {
+  return trace_ + cursor.offset + sizeof(EdgeTpuTraceRecord);
+}
+
+void EdgeTpuReplayTransport::Advance(Channel channel, Cursor* cursor) const {
+  EdgeTpuTraceRecord record;
+  cursor->consumed = 0;
+  while (Current(*cursor, &record)) {
+    cursor->offset += sizeof(record) + PayloadSize(record.op, record.length);
+    if (Current(*cursor, &record) && ChannelOf(record.op) == channel) return;
+  }
+}
+
+bool EdgeTpuReplayTransport::Mismatch(const char* what) {
+  ++mismatches_;
+  printf("Edge TPU trace mismatch: %s\r\n", what);
+  return false;
+}
+
+bool EdgeTpuReplayTransport::CanTransferInPlace(const void* data,
+                                                uint32_t length,
+                                                uint32_t alignment) const {
+  return reinterpret_cast<uintptr_t>(data) % alignment == 0;
+}
+
+bool EdgeTpuReplayTransport::Control(const EdgeTpuControlRequest& request,
+                                     EdgeTpuTransfer* transfer) {
+  Cursor& cursor = cursors_[kControl];
+  EdgeTpuTraceRecord record;
+  if (!Current(cursor, &record)) return Mismatch("control past end of trace");
+  const auto op = request.read ? EdgeTpuTraceOp::kControlRead
+                               : EdgeTpuTraceOp::kControlWrite;
+  if (record.op != op || record.request != request.request ||
+      record.address != ControlAddress(request) ||
+      record.length != transfer->length) {
+    return Mismatch("control request");
+  }
+  if (request.read) {
+    memcpy(transfer->data, Payload(cursor), record.transferred);
+  } else if (verify_data_ &&
+             record.checksum !=
+                 EdgeTpuTraceChecksum(transfer->data, transfer->length)) {
+    return Mismatch("control data");
+  }
+  Advance(kControl, &cursor);
+  Complete(transfer, record.transferred, record.ok);
+  return true;
+}
+
+bool EdgeTpuReplayTransport::BulkOut(EdgeTpuTransfer* transfer) {
+  Cursor& cursor = cursors_[kBulkOut];
+  EdgeTpuTraceRecord record;
+  if (!Current(cursor, &record)) return Mismatch("bulk-out past end of trace");
+  if (record.length != transfer->length) {
+    return Mismatch("bulk-out length");
+  }
+  if (verify_data_ &&
+      record.checksum !=
+          EdgeTpuTraceChecksum(transfer->data, transfer->length)) {
+    return Mismatch("bulk-out data");
+  }
+  Advance(kBulkOut, &cursor);
+  Complete(transfer, record.transferred, record.ok);
+  return true;
+}
+
+bool EdgeTpuReplayTransport::BulkIn(EdgeTpuTransfer* transfer) {
+  Cursor& cursor = cursors_[kBulkIn];
+  EdgeTpuTraceRecord record;
+  if (!Current(cursor, &record)) return Mismatch("bulk-in past end of trace");
+
+  // Recorded reads are one stream; a read only stops early where the device
+  // ended one short or failed.
+  uint32_t served = 0;
+  bool ok = true;
+  while (served < transfer->length && Current(cursor, &record)) {
+    const uint32_t count = std::min(record.transferred - cursor.consumed,
+                                    transfer->length - served);
+    memcpy(transfer->data + served, Payload(cursor) + cursor.consumed, count);
+    served += count;
+    cursor.consumed += count;
+    ok = record.ok;
+    if (cursor.consumed == record.transferred) {
+      Advance(kBulkIn, &cursor);
+      if (!record.ok || record.transferred < record.length) break;
+    }
+  }
+  Complete(transfer, served, ok);
+  return true;
+}
+
+bool EdgeTpuReplayTransport::ReadEvent(EdgeTpuTransfer* transfer) {
+  Cursor& cursor = cursors_[kEvent];
+  EdgeTpuTraceRecord record;
+  if (!Current(cursor, &record)) return Mismatch("event past end of trace");
+  const uint32_t count = std::min(record.transferred, transfer->length);
+  memcpy(transfer->data, Payload(cursor), count);
+  Advance(kEvent, &cursor);
+  Complete(transfer, count, record.ok);
+  return true;
+}
+
+}  // namespace coralmicro
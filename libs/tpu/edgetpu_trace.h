@@ -0,0 +1,194 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_TRACE_H_
+#define LIBS_TPU_EDGETPU_TRACE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "libs/tpu/edgetpu_transport.h"
+
+namespace coralmicro {
+
+// Edge TPU transfer traces.
+//
+// A trace is a flat, little-endian byte buffer: an `EdgeTpuTraceHeader`
+// followed by one `EdgeTpuTraceRecord` per transfer, each followed by the
+// data the device returned for reads (padded to 4 bytes). Writes are only
+// kept as a length and checksum. Traces don't depend on FreeRTOS or the NXP
+// SDK, so a trace captured on the board (for example saved with
+// `LfsWriteFile()`) can be replayed on the board or on a host build.
+
+inline constexpr uint32_t kEdgeTpuTraceMagic = 0x54505445;  // "ETPT"
+inline constexpr uint32_t kEdgeTpuTraceVersion = 1;
+
+enum class EdgeTpuTraceOp : uint8_t {
+  kControlRead,
+  kControlWrite,
+  kBulkOut,
+  kBulkIn,
+  kEvent,
+};
+
+struct EdgeTpuTraceHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct EdgeTpuTraceRecord {
+  EdgeTpuTraceOp op;
+  // Whether the transfer completed successfully.
+  uint8_t ok;
+  // Control requests only: the request and register address.
+  uint8_t request;
+  uint8_t reserved;
+  uint32_t address;
+  // Bytes requested and bytes actually transferred.
+  uint32_t length;
+  uint32_t transferred;
+  // `EdgeTpuTraceChecksum()` of the data written, 0 for reads.
+  uint32_t checksum;
+};
+
+// FNV-1a hash used to compare written data against a trace.
+uint32_t EdgeTpuTraceChecksum(const uint8_t* data, uint32_t length);
+
+// Forwards transfers to another transport and appends them to a trace.
+//
+// The trace is written into a caller-provided buffer, so recording doesn't
+// allocate and completions can be recorded from interrupt context. Once the
+// buffer is full (or too many transfers are in flight), transfers pass
+// through unrecorded and `overflowed()` is set. Submissions must come from
+// one task at a time, as `TpuDriver` does.
+class EdgeTpuRecordingTransport : public EdgeTpuTransport {
+ public:
+  EdgeTpuRecordingTransport(EdgeTpuTransport* transport, uint8_t* buffer,
+                            size_t capacity);
+
+  // Discards the recorded transfers.
+  void Reset();
+  // The trace recorded so far.
+  const uint8_t* data() const { return buffer_; }
+  size_t size() const { return used_; }
+  bool overflowed() const { return overflowed_; }
+
+  bool Connected() const override { return transport_->Connected(); }
+  bool CanTransferInPlace(const void* data, uint32_t length,
+                          uint32_t alignment) const override {
+    return transport_->CanTransferInPlace(data, length, alignment);
+  }
+
+  bool Control(const EdgeTpuControlRequest& request,
+               EdgeTpuTransfer* transfer) override;
+  bool BulkOut(EdgeTpuTransfer* transfer) override;
+  bool BulkIn(EdgeTpuTransfer* transfer) override;
+  bool ReadEvent(EdgeTpuTransfer* transfer) override;
+  void CancelEvent() override { transport_->CancelEvent(); }
+
+ private:
+  // A transfer forwarded on behalf of the caller's `transfer`.
+  struct Pending : EdgeTpuTransfer {
+    EdgeTpuRecordingTransport* self = nullptr;
+    EdgeTpuTransfer* transfer = nullptr;
+    EdgeTpuTraceRecord* record = nullptr;
+    volatile bool in_use = false;
+  };
+  // More than `TpuDriver` ever has in flight.
+  static constexpr int kMaxPending = 8;
+
+  // Reserves a record and starts a `Pending` for `transfer`, or returns
+  // nullptr if the transfer can't be recorded.
+  Pending* Begin(EdgeTpuTraceOp op, EdgeTpuTransfer* transfer);
+  // Forwards `transfer` through `submit`, recording it if possible.
+  template <typename Submit>
+  bool Forward(EdgeTpuTraceOp op, EdgeTpuTransfer* transfer, Submit submit);
+  static void Done(EdgeTpuTransfer* transfer);
+
+  EdgeTpuTransport* transport_;
+  uint8_t* buffer_;
+  size_t capacity_;
+  size_t used_ = 0;
+  bool overflowed_ = false;
+  Pending pending_[kMaxPending];
+  int next_pending_ = 0;
+};
+
+// Plays a trace back in place of the Edge TPU.
+//
+// Every transfer completes before its submit call returns, with the result
+// and data the device produced when the trace was recorded, so timings taken
+// over a replay measure only host-side overhead. Each channel (control,
+// bulk-out, bulk-in and events) is matched against the trace in order. Reads
+// are served as a stream, so they may be split differently than when
+// recorded. A transfer that doesn't match the trace fails.
+class EdgeTpuReplayTransport : public EdgeTpuTransport {
+ public:
+  // `trace` must outlive this transport.
+  EdgeTpuReplayTransport(const uint8_t* trace, size_t size);
+
+  // Whether `trace` is a well-formed trace.
+  bool valid() const { return valid_; }
+  // Starts over from the first transfer, e.g. to replay an invoke repeatedly.
+  void Rewind();
+  // Whether written data must match the recorded checksums. Off by default,
+  // since inputs usually differ between recording and replay.
+  void set_verify_data(bool verify) { verify_data_ = verify; }
+  // Transfers that didn't match the trace since the last `Rewind()`.
+  uint32_t mismatches() const { return mismatches_; }
+  // Whether every recorded transfer has been replayed.
+  bool done() const;
+
+  bool Connected() const override { return valid_; }
+  bool CanTransferInPlace(const void* data, uint32_t length,
+                          uint32_t alignment) const override;
+
+  bool Control(const EdgeTpuControlRequest& request,
+               EdgeTpuTransfer* transfer) override;
+  bool BulkOut(EdgeTpuTransfer* transfer) override;
+  bool BulkIn(EdgeTpuTransfer* transfer) override;
+  bool ReadEvent(EdgeTpuTransfer* transfer) override;
+
+ private:
+  enum Channel { kControl, kBulkOut, kBulkIn, kEvent, kChannelCount };
+
+  // Position of the next record to replay on one channel.
+  struct Cursor {
+    size_t offset;
+    // Bytes of the current record's data already served (bulk-in only).
+    uint32_t consumed;
+  };
+
+  static Channel ChannelOf(EdgeTpuTraceOp op);
+  // Reads the cursor's current record, returning false at the end of the
+  // trace.
+  bool Current(const Cursor& cursor, EdgeTpuTraceRecord* record) const;
+  const uint8_t* Payload(const Cursor& cursor) const;
+  // Moves to the next record on `channel`.
+  void Advance(Channel channel, Cursor* cursor) const;
+  bool Mismatch(const char* what);
+
+  const uint8_t* trace_;
+  size_t size_;
+  bool valid_ = false;
+  bool verify_data_ = false;
+  uint32_t mismatches_ = 0;
+  Cursor cursors_[kChannelCount];
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_TRACE_H_
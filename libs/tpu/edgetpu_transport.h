@@ -0,0 +1,77 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_TRANSPORT_H_
+
+#include <cstdint>
+
+namespace coralmicro {
+
+// One transfer submitted to an `EdgeTpuTransport`. When it completes, the
+// transport fills in `transferred` and `ok` and then calls `done`, possibly
+// from an interrupt handler or before the submitting call returns.
+struct EdgeTpuTransfer {
+  uint8_t* data = nullptr;
+  uint32_t length = 0;
+  volatile uint32_t transferred = 0;
+  volatile bool ok = false;
+  void (*done)(EdgeTpuTransfer* transfer) = nullptr;
+};
+
+// A vendor control request addressing an Edge TPU register.
+struct EdgeTpuControlRequest {
+  bool read;
+  uint8_t request;
+  uint16_t value;
+  uint16_t index;
+};
+
+// The link between `TpuDriver` and the Edge TPU. `EdgeTpuUsbTransport` talks
+// to the chip over USB; the transports in `edgetpu_trace.h` record that
+// traffic and play it back without a device.
+//
+// Submit calls return false if the transfer couldn't be queued, in which case
+// `done` is never called. Transfers on the same channel complete in order.
+class EdgeTpuTransport {
+ public:
+  virtual ~EdgeTpuTransport() = default;
+
+  // Whether a device is attached and transfers can be submitted.
+  virtual bool Connected() const = 0;
+
+  // Whether `length` bytes at `data` can be handed to the transport as is.
+  // Otherwise the driver copies them through its own buffers.
+  virtual bool CanTransferInPlace(const void* data, uint32_t length,
+                                  uint32_t alignment) const = 0;
+
+  // Reads or writes `transfer->length` bytes of a register.
+  virtual bool Control(const EdgeTpuControlRequest& request,
+                       EdgeTpuTransfer* transfer) = 0;
+  // Sends descriptors and their data.
+  virtual bool BulkOut(EdgeTpuTransfer* transfer) = 0;
+  // Receives output activations.
+  virtual bool BulkIn(EdgeTpuTransfer* transfer) = 0;
+  // Receives the next completion event.
+  virtual bool ReadEvent(EdgeTpuTransfer* transfer) = 0;
+  // Abandons any `ReadEvent()` still queued. Its `done` may be called before
+  // this returns, but not after.
+  virtual void CancelEvent() {}
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_TRANSPORT_H_
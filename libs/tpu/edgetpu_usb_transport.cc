@@ -0,0 +1,121 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_usb_transport.h"
+
+#include <cstdio>
+
+#include "third_party/nxp/rt1176-sdk/middleware/usb/include/usb_spec.h"
+
+namespace coralmicro {
+namespace {
+constexpr uint8_t kSingleBulkOutEndpoint = 1;
+constexpr uint8_t kEventInEndpoint = 2;
+
+struct MemoryRegion {
+  uintptr_t start;
+  uintptr_t end;
+};
+// Memory reachable by the USB controller's DMA: DTCM, OCRAM and SDRAM.
+constexpr MemoryRegion kUsbDmaRegions[] = {
+    {0x20000000, 0x20040000},
+    {0x20240000, 0x20340000},
+    {0x80000000, 0x83000000},
+};
+
+void TransferCallback(void *param, uint8_t *data, uint32_t data_length,
+                      usb_status_t status) {
+  auto *transfer = static_cast<EdgeTpuTransfer *>(param);
+  transfer->transferred = data_length;
+  transfer->ok = status == kStatus_USB_Success;
+  transfer->done(transfer);
+}
+}  // namespace
+
+bool EdgeTpuUsbTransport::CanTransferInPlace(const void *data,
+                                             uint32_t length,
+                                             uint32_t alignment) const {
+  const auto start = reinterpret_cast<uintptr_t>(data);
+  if (start % alignment != 0) {
+    return false;
+  }
+  for (const auto &region : kUsbDmaRegions) {
+    if (start >= region.start && start + length <= region.end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EdgeTpuUsbTransport::Control(const EdgeTpuControlRequest &request,
+                                  EdgeTpuTransfer *transfer) {
+  usb_setup_struct_t setup_packet;
+  setup_packet.bmRequestType =
+      USB_REQUEST_TYPE_TYPE_VENDOR | USB_REQUEST_TYPE_RECIPIENT_DEVICE;
+  setup_packet.bmRequestType |=
+      request.read ? USB_REQUEST_TYPE_DIR_IN : USB_REQUEST_TYPE_DIR_OUT;
+  setup_packet.bRequest = request.request;
+  setup_packet.wValue = request.value;
+  setup_packet.wIndex = request.index;
+  setup_packet.wLength = transfer->length;
+  if (USB_HostEdgeTpuControl(instance_, &setup_packet, transfer->data,
+                             TransferCallback,
+                             transfer) != kStatus_USB_Success) {
+    printf("USB_HostEdgeTpuControl failed\r\n");
+    return false;
+  }
+  return true;
+}
+
+bool EdgeTpuUsbTransport::BulkOut(EdgeTpuTransfer *transfer) {
+  if (USB_HostEdgeTpuBulkOutSend(instance_, kSingleBulkOutEndpoint,
+                                 transfer->data, transfer->length,
+                                 TransferCallback,
+                                 transfer) != kStatus_USB_Success) {
+    printf("USB_HostEdgeTpuBulkOutSend failed\r\n");
+    return false;
+  }
+  return true;
+}
+
+bool EdgeTpuUsbTransport::BulkIn(EdgeTpuTransfer *transfer) {
+  if (USB_HostEdgeTpuBulkInRecv(instance_, kSingleBulkOutEndpoint,
+                                transfer->data, transfer->length,
+                                TransferCallback,
+                                transfer) != kStatus_USB_Success) {
+    printf("USB_HostEdgeTpuBulkInRecv failed\r\n");
+    return false;
+  }
+  return true;
+}
+
+bool EdgeTpuUsbTransport::ReadEvent(EdgeTpuTransfer *transfer) {
+  if (USB_HostEdgeTpuBulkInRecv(instance_, kEventInEndpoint, transfer->data,
+                                transfer->length, TransferCallback,
+                                transfer) != kStatus_USB_Success) {
+    printf("ReadEvent failed\r\n");
+    return false;
+  }
+  return true;
+}
+
+void EdgeTpuUsbTransport::CancelEvent() {
+  if (instance_) {
+    USB_HostEdgeTpuCancel(instance_, kEventInEndpoint, USB_IN);
+  }
+}
+
+}  // namespace coralmicro
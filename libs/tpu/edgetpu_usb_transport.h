@@ -0,0 +1,54 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
+
+#include "libs/tpu/edgetpu_transport.h"
+#include "libs/tpu/usb_host_edgetpu.h"
+
+namespace coralmicro {
+
+// Talks to the Edge TPU through the USB host class driver.
+//
+// Memory the USB controller can reach (DTCM, OCRAM and SDRAM) is transferred
+// in place. The EHCI driver maintains the D-cache around each transfer
+// (`USB_HOST_CONFIG_BUFFER_PROPERTY_CACHEABLE`).
+class EdgeTpuUsbTransport : public EdgeTpuTransport {
+ public:
+  // Sets the attached device, or nullptr once it leaves the bus.
+  void set_instance(usb_host_edgetpu_instance_t* instance) {
+    instance_ = instance;
+  }
+
+  bool Connected() const override { return instance_ != nullptr; }
+  bool CanTransferInPlace(const void* data, uint32_t length,
+                          uint32_t alignment) const override;
+
+  bool Control(const EdgeTpuControlRequest& request,
+               EdgeTpuTransfer* transfer) override;
+  bool BulkOut(EdgeTpuTransfer* transfer) override;
+  bool BulkIn(EdgeTpuTransfer* transfer) override;
+  bool ReadEvent(EdgeTpuTransfer* transfer) override;
+  void CancelEvent() override;
+
+ private:
+  usb_host_edgetpu_instance_t* instance_ = nullptr;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_USB_TRANSPORT_H_
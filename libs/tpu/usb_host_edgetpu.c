@@ -85,9 +85,10 @@ usb_status_t USB_HostEdgeTpuDeinit(usb_device_handle deviceHandle, usb_host_clas
             }
         }
 
-        if ((tpuInstance->controlPipe != NULL) && (tpuInstance->controlTransfer != NULL))
+        if (tpuInstance->controlPipe != NULL)
         {
-            status = USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->controlPipe, tpuInstance->controlTransfer);
+            /* Cancels the SET_INTERFACE request and every queued vendor request. */
+            status = USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->controlPipe, NULL);
         }
         USB_HostCloseDeviceInterface(deviceHandle, tpuInstance->interfaceHandle);
         OSA_MemoryFree(tpuInstance);
@@ -338,31 +339,64 @@ static int8_t USB_HostEdgeTpuGetPipeIndexFromEndpoint(usb_host_edgetpu_instance_
 }
 
 
+static usb_host_edgetpu_pending_transfer_t *USB_HostEdgeTpuGetFreePendingSlot(usb_host_edgetpu_pipe_t *pipe)
+{
+    for (int i = 0; i < USB_EDGETPU_MAX_PENDING_TRANSFERS; i++)
+    {
+        if (pipe->pendingTransfers[i].transfer == NULL)
+        {
+            return &pipe->pendingTransfers[i];
+        }
+    }
+    return NULL;
+}
+
+static void USB_HostEdgeTpuReleasePendingSlot(usb_host_edgetpu_pipe_t *pipe,
+                                              usb_host_edgetpu_pending_transfer_t *pending)
+{
+    pending->transfer = NULL;
+    for (int i = 0; i < USB_EDGETPU_MAX_PENDING_TRANSFERS; i++)
+    {
+        if (pipe->pendingTransfers[i].transfer != NULL)
+        {
+            return;
+        }
+    }
+    pipe->transferStatus = USB_EDGETPU_TRANSFER_READY;
+}
+
+
 static void USB_HostEdgeTpuPipeCallback(void *param,
                                            usb_host_transfer_t *transfer,
                                            usb_status_t status)
 {
     usb_host_edgetpu_instance_t *tpuInstance = (usb_host_edgetpu_instance_t *)param;
-    int8_t index = -1;
     for (int i = 0; i < USB_EDGETPU_ENDPOINT_NUM; i++)
     {
-        if (tpuInstance->pipes[i].activeTransfer == transfer) {
-            index = i;
-            break;
-        }
-    }
-    if (!(index < 0)) {
-        usb_host_edgetpu_pipe_t *edgeTpuPipe = &tpuInstance->pipes[index];
-        if (edgeTpuPipe->callbackFn != NULL) {
-            edgeTpuPipe->callbackFn(edgeTpuPipe->callbackParam, transfer->transferBuffer, transfer->transferSofar, status);
+        usb_host_edgetpu_pipe_t *edgeTpuPipe = &tpuInstance->pipes[i];
+        for (int j = 0; j < USB_EDGETPU_MAX_PENDING_TRANSFERS; j++)
+        {
+            usb_host_edgetpu_pending_transfer_t *pending = &edgeTpuPipe->pendingTransfers[j];
+            if (pending->transfer != transfer)
+            {
+                continue;
+            }
+            // Release the slot before calling back, so the woken submitter can
+            // immediately queue its next transfer on this pipe.
+            transfer_callback_t callbackFn = pending->callbackFn;
+            void *callbackParam = pending->callbackParam;
+            USB_HostEdgeTpuReleasePendingSlot(edgeTpuPipe, pending);
+            if (callbackFn != NULL)
+            {
+                callbackFn(callbackParam, transfer->transferBuffer, transfer->transferSofar, status);
+            }
+            USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
+            return;
         }
-        edgeTpuPipe->activeTransfer = NULL;
-        edgeTpuPipe->transferStatus = USB_EDGETPU_TRANSFER_READY;
     }
     USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
 }
 
-
 usb_status_t USB_HostEdgeTpuBulkOutSend(usb_host_edgetpu_instance_t *tpuInstance,
                                             uint8_t endPoint,
                                             uint8_t* buffer,
@@ -386,6 +420,12 @@ usb_status_t USB_HostEdgeTpuBulkOutSend(usb_host_edgetpu_instance_t *tpuInstance
         return kStatus_USB_InvalidParameter;
     }
 
+    usb_host_edgetpu_pending_transfer_t *pending = USB_HostEdgeTpuGetFreePendingSlot(pipe);
+    if (pending == NULL)
+    {
+        return kStatus_USB_Busy;
+    }
+
     if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
     {
         return kStatus_USB_Error;
@@ -397,14 +437,13 @@ usb_status_t USB_HostEdgeTpuBulkOutSend(usb_host_edgetpu_instance_t *tpuInstance
     transfer->callbackParam = tpuInstance;
     transfer->direction = USB_OUT;
     pipe->transferStatus = USB_EDGETPU_TRANSFER_BUSY;
-    pipe->callbackFn = callbackFn;
-    pipe->callbackParam = callbackParam;
-    pipe->activeTransfer = transfer;
+    pending->callbackFn = callbackFn;
+    pending->callbackParam = callbackParam;
+    pending->transfer = transfer;
 
     if (USB_HostSend(tpuInstance->hostHandle, pipe->pipeHandle, transfer) != kStatus_USB_Success)
     {
-        pipe->transferStatus = USB_EDGETPU_TRANSFER_READY;
-        pipe->activeTransfer = NULL;
+        USB_HostEdgeTpuReleasePendingSlot(pipe, pending);
         USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
         return kStatus_USB_Error;
     }
@@ -435,16 +474,22 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
         return kStatus_USB_InvalidParameter;
     }
 
+    usb_host_edgetpu_pending_transfer_t *pending = USB_HostEdgeTpuGetFreePendingSlot(pipe);
+    if (pending == NULL)
+    {
+        return kStatus_USB_Busy;
+    }
+
     // Allocate memory for transfer
     if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
     {
         return kStatus_USB_Error;
     }
 
-    pipe->callbackFn = callbackFn;
-    pipe->callbackParam = callbackParam;
-    pipe->activeTransfer = transfer;
     pipe->transferStatus = USB_EDGETPU_TRANSFER_BUSY;
+    pending->callbackFn = callbackFn;
+    pending->callbackParam = callbackParam;
+    pending->transfer = transfer;
     transfer->transferBuffer = buffer;
     transfer->transferLength = length;
     transfer->callbackFn = USB_HostEdgeTpuPipeCallback;
@@ -453,8 +498,7 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
 
     if (USB_HostRecv(tpuInstance->hostHandle, pipe->pipeHandle, transfer) != kStatus_USB_Success)
     {
-        pipe->transferStatus = USB_EDGETPU_TRANSFER_READY;
-        pipe->activeTransfer = NULL;
+        USB_HostEdgeTpuReleasePendingSlot(pipe, pending);
         USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
         return kStatus_USB_Error;
     }
@@ -462,17 +506,40 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
 }
 
 
+usb_status_t USB_HostEdgeTpuCancel(usb_host_edgetpu_instance_t *tpuInstance,
+                                   uint8_t endPoint,
+                                   uint8_t direction)
+{
+    int8_t index = USB_HostEdgeTpuGetPipeIndexFromEndpoint(tpuInstance, endPoint, direction);
+    if (index < 0 || tpuInstance->pipes[index].pipeHandle == NULL)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    return USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->pipes[index].pipeHandle, NULL);
+}
+
+
 static void USB_HostEdgeTpuControlPipeCallback(void *param, usb_host_transfer_t *transfer, usb_status_t status)
 {
     usb_host_edgetpu_instance_t *tpuInstance = (usb_host_edgetpu_instance_t *)param;
 
-    if (tpuInstance->controlCallbackFn != NULL)
+    for (int i = 0; i < USB_EDGETPU_MAX_PENDING_TRANSFERS; i++)
     {
-        tpuInstance->controlCallbackFn(tpuInstance->controlCallbackParam, transfer->transferBuffer,
-                                       transfer->transferSofar, status);
+        usb_host_edgetpu_pending_transfer_t *pending = &tpuInstance->pendingControlTransfers[i];
+        if (pending->transfer != transfer)
+        {
+            continue;
+        }
+        transfer_callback_t callbackFn = pending->callbackFn;
+        void *callbackParam = pending->callbackParam;
+        pending->transfer = NULL;
+        if (callbackFn != NULL)
+        {
+            callbackFn(callbackParam, transfer->transferBuffer, transfer->transferSofar, status);
+        }
+        break;
     }
     USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
-    tpuInstance->controlTransferStatus = USB_EDGETPU_TRANSFER_BUSY;
 }
 
 
@@ -483,12 +550,26 @@ usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
                                                void *callbackParam)
 {
     usb_host_transfer_t *transfer;
+    usb_host_edgetpu_pending_transfer_t *pending = NULL;
+    for (int i = 0; i < USB_EDGETPU_MAX_PENDING_TRANSFERS; i++)
+    {
+        if (tpuInstance->pendingControlTransfers[i].transfer == NULL)
+        {
+            pending = &tpuInstance->pendingControlTransfers[i];
+            break;
+        }
+    }
+    if (pending == NULL)
+    {
+        return kStatus_USB_Busy;
+    }
     if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
     {
         return kStatus_USB_Error;
     }
-    tpuInstance->controlCallbackFn = callbackFn;
-    tpuInstance->controlCallbackParam = callbackParam;
+    pending->callbackFn = callbackFn;
+    pending->callbackParam = callbackParam;
+    pending->transfer = transfer;
     transfer->transferBuffer = buffer;
     transfer->transferLength = setupPacket->wLength;
     transfer->callbackFn = USB_HostEdgeTpuControlPipeCallback;
@@ -499,15 +580,13 @@ usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
     transfer->setupPacket->wIndex = USB_SHORT_TO_LITTLE_ENDIAN(setupPacket->wIndex);
     transfer->setupPacket->wLength = USB_SHORT_TO_LITTLE_ENDIAN(setupPacket->wLength);
 
-    tpuInstance->controlTransferStatus = USB_EDGETPU_TRANSFER_BUSY;
     if (USB_HostSendSetup(tpuInstance->hostHandle,
                           tpuInstance->controlPipe, transfer) != kStatus_USB_Success)
     {
+        pending->transfer = NULL;
         USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
-        tpuInstance->controlTransferStatus = USB_EDGETPU_TRANSFER_BUSY;
         return kStatus_USB_Error;
     }
-    tpuInstance->controlTransfer = transfer;
     return kStatus_USB_Success;
 }
 
@@ -31,6 +31,7 @@
 #define USB_EDGETPU_BULK_OUT_PACKET_SIZE 512
 #define USB_EDGETPU_BULK_IN_PACKET_SIZE 256
 #define USB_EDGETPU_INTERRRUPT_ENDPOINT_INDEX 5
+#define USB_EDGETPU_MAX_PENDING_TRANSFERS 4
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,15 +42,21 @@ typedef enum {
   USB_EDGETPU_TRANSFER_BUSY,
 } usb_host_edgetpu_transfer_status_t;
 
+typedef struct _usb_host_edgetpu_pending_transfer {
+  usb_host_transfer_t *transfer; /*!< NULL when the slot is free */
+  transfer_callback_t callbackFn;
+  void *callbackParam;
+} usb_host_edgetpu_pending_transfer_t;
+
 typedef struct _usb_host_edgetpu_pipe {
   usb_host_pipe_handle pipeHandle;
   uint8_t pipeType;
   uint16_t packetSize;
   uint8_t endPoint;
   uint8_t direction;
-  transfer_callback_t callbackFn;
-  void *callbackParam;
-  usb_host_transfer_t *activeTransfer;
+  /* Transfers queued on this pipe, completed in submission order. */
+  usb_host_edgetpu_pending_transfer_t
+      pendingTransfers[USB_EDGETPU_MAX_PENDING_TRANSFERS];
   usb_host_edgetpu_transfer_status_t transferStatus;
   bool connected;
 } usb_host_edgetpu_pipe_t;
@@ -62,11 +69,14 @@ typedef struct _usb_host_edgetpu_instance {
   usb_host_edgetpu_pipe_t pipes[USB_EDGETPU_ENDPOINT_NUM]; /* pipes */
   usb_host_pipe_handle
       controlPipe; /*!< This instance's related device control pipe*/
-  usb_host_transfer_t *controlTransfer; /*!< Ongoing control transfer*/
+  usb_host_transfer_t *controlTransfer; /*!< Ongoing SET_INTERFACE transfer*/
   transfer_callback_t
-      controlCallbackFn;      /*!< control transfer callback function pointer*/
-  void *controlCallbackParam; /*!< control transfer callback parameter*/
-  usb_host_edgetpu_transfer_status_t controlTransferStatus;
+      controlCallbackFn;      /*!< SET_INTERFACE callback function pointer*/
+  void *controlCallbackParam; /*!< SET_INTERFACE callback parameter*/
+  /* Vendor control transfers queued on the control pipe, completed in
+   * submission order. */
+  usb_host_edgetpu_pending_transfer_t
+      pendingControlTransfers[USB_EDGETPU_MAX_PENDING_TRANSFERS];
 } usb_host_edgetpu_instance_t;
 
 usb_status_t USB_HostEdgeTpuInit(usb_device_handle deviceHandle,
@@ -100,6 +110,11 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
                                        transfer_callback_t callbackFn,
                                        void *callbackParam);
 
+/* Cancels every transfer queued on an endpoint. Their callbacks are called
+ * with kStatus_USB_TransferCancel before this returns. */
+usb_status_t USB_HostEdgeTpuCancel(usb_host_edgetpu_instance_t *tpuInstance,
+                                   uint8_t endPoint, uint8_t direction);
+
 usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
                                     usb_setup_struct_t *setupPacket,
                                     uint8_t *buffer,